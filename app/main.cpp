@@ -1,103 +1,120 @@
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
+#include <avr/eeprom.h>
 
+#include <util/atomic.h>
+#include <util/crc16.h>
 #include <util/delay.h>
 
 #include <uart.h>
+#include <Eeprom.h>
 #include <SSD1306.h>
+#include <mhz19.h>
 
 #include <DHT22_AM2302_v3.h>
 
 
-class SSegmentRender {
+/*
+	 Segment codes
+   ***** <- 0
+
+	 **0** <- top
+	 *   *
+	 5   1
+	 **6**
+	 *   *
+	 4   2
+	 **3** <- width-1
+	 bit 7: glyph is half width
+ */
+constexpr uint8_t d2s[17] PROGMEM = {
+	0b00111111, // 0
+	0b10000110, // 1
+	0b01011011, // 2
+	0b01001111, // 3
+	0b01100110, // 4
+	0b01101101, // 5
+	0b01111101, // 6
+	0b00000111, // 7
+	0b01111111, // 8
+	0b01101111, // 9
+	0b11000000, // - (10)
+	0b01110110, // H (11)
+	0b00111001, // C (12)
+	0b00111110, // U (13)
+	0b01110011, // P (14)
+	0b00111000, // L (15)
+	0b10001000, // . (16)
+};
+
+// All glyphs of one size, rendered by the compiler. Each glyph is stored
+// page by page with a stride of width columns, half width glyphs use the
+// left half of their cell.
+template <uint8_t width, uint8_t pages>
+class SSegmentAtlas {
 
 public:
-	SSegmentRender(uint8_t width, uint8_t pages)
-		: width(width), pages(pages) {}
+	static constexpr uint8_t glyphs = sizeof(d2s);
+
+	constexpr SSegmentAtlas()
+		: data{}
+	{
+		for(uint8_t s = 0; s < glyphs; ++s) {
+			draw(s);
+		}
+	}
 
-	SSegmentRender() = delete;
+	uint8_t data[glyphs][width * pages];
 
-	int draw(int s, uint8_t width, uint8_t pages, uint8_t * b) {
-		memset(b, 0, width * pages);
+private:
+	constexpr void draw(uint8_t s) {
 		const uint8_t c = d2s[s];
 		const uint8_t top = pages*2;
 		const uint8_t h = pages * 8 - top;
 		const uint8_t half = h/2;
+		uint8_t w = width;
 
 		if(c&0b10000000) {
-			width = width/2;
+			w = w/2;
 		}
 		
 		if(c&0b00000001) {
-			drawLineH(b, 0, 0, width);
+			drawLineH(s, 0, 0, w);
 		}
 		if(c&0b00000010) {
-			drawLineV(b, width-1, 0, half);
+			drawLineV(s, w-1, 0, half);
 		}
 		if(c&0b00000100) {
-			drawLineV(b, width-1, half, half);
+			drawLineV(s, w-1, half, half);
 		}
 		if(c&0b00001000) {
-			drawLineH(b, 0, h-1, width);
+			drawLineH(s, 0, h-1, w);
 		}
 		if(c&0b00010000) {
-			drawLineV(b, 0, h/2, h/2);
+			drawLineV(s, 0, h/2, h/2);
 		}
 		if(c&0b00100000) {
-			drawLineV(b, 0, 0, h/2);
+			drawLineV(s, 0, 0, h/2);
 		}
 		if(c&0b01000000) {
-			drawLineH(b, 0, h/2, width);
+			drawLineH(s, 0, h/2, w);
 		}
-		return width;
 	}
 
-private:
-	uint8_t width = 0;
-	uint8_t pages = 0;
-/*
-	 Segment codes
-   ***** <- 0
-
-	 **0** <- top
-	 *   *
-	 5   1
-	 **6**
-	 *   *
-	 4   2
-	 **3** <- width-1
- */
- const uint8_t d2s[15] = {
-		0b00111111, // 0
-		0b10000110, // 1
-		0b01011011, // 2
-		0b01001111, // 3
-		0b01100110, // 4
-		0b01101101, // 5
-		0b01111101, // 6
-		0b00000111, // 7
-		0b01111111, // 8
-		0b01101111, // 9
-		0b11000000, // - (10)
-		0b01110110, // H (11)
-		0b00111001, // C (12)
-		0b00111110, // U (13)
-		0b01110011, // P (14)
-	};
-
- void drawLineH(uint8_t * b, uint8_t x, uint8_t y, uint8_t len) {
+	constexpr void drawLineH(uint8_t s, uint8_t x, uint8_t y, uint8_t len) {
 		uint8_t pattern = 1;
 		pattern <<= y%8;
 		for(int i = 0; i < len; ++i) {
-			b[(y/8)*width + x + i] |= pattern;
+			data[s][(y/8)*width + x + i] |= pattern;
 		}
- }
+	}
 
-	void drawLineV(uint8_t * b, uint8_t x, uint8_t y, uint8_t len) {
+	constexpr void drawLineV(uint8_t s, uint8_t x, uint8_t y, uint8_t len) {
 
 		int startPage = y/8;
 		int startPageYOffset = y%8;
@@ -112,7 +129,7 @@ private:
 			pattern <<= 1;
 		}
 		
-		b[x + startPage * width] |= pattern;
+		data[s][x + startPage * width] |= pattern;
 		// remove drawed part from len
 
 		if(len >= 8-(y%8)) {
@@ -125,7 +142,7 @@ private:
 		while(len > 8) {
 			k++;
 			len -= 8;
-			b[(startPage + k)*width + x] = 0xFF;
+			data[s][(startPage + k)*width + x] = 0xFF;
 		}
 
 
@@ -138,153 +155,859 @@ private:
 			pattern <<= 1;
 			pattern |= 1;
 		}
-		b[(startPage+k+1)*width + x] |= pattern;
+		data[s][(startPage+k+1)*width + x] |= pattern;
 	}
 };
 
+// One flash copy per glyph size; only the sizes a printer uses get built
+template <uint8_t width, uint8_t pages>
+struct SSegmentFont {
+	static const SSegmentAtlas<width, pages> atlas;
+};
+
+template <uint8_t width, uint8_t pages>
+const SSegmentAtlas<width, pages> SSegmentFont<width, pages>::atlas PROGMEM = SSegmentAtlas<width, pages>();
+
 
 class NumberPrinter {
 	public:
 		NumberPrinter() = delete;
-		NumberPrinter(SSD1306 & oled, uint8_t width, uint8_t pages)
-			: width(width), pages(pages), oled(oled), render(SSegmentRender(width, pages))
-		{
-			buf = static_cast<uint8_t*>(malloc(width*pages));
-		}
-		~NumberPrinter() {
-			free(buf);
-		}
+		template <uint8_t w, uint8_t p>
+		NumberPrinter(SSD1306 & oled, const SSegmentAtlas<w, p> & atlas)
+			: width(w), pages(p), oled(oled), glyphs(atlas.data[0])
+		{}
 
 		void clear(uint8_t x, uint8_t startPage, uint8_t w) {
-			for (int i = 0; i < pages; ++i) {
-				oled.clearPage(startPage + i, x, w);
-			}
+			oled.clearPages(startPage, pages, x, w);
 		}
 
+		// The glyph goes to the panel straight from flash
 		int print(int s, int offset, int startPage) {
-			memset(buf, 0, width*pages);
-			int glyphWidth = render.draw(s, width, pages, buf);
-			for (int i = 0; i < pages; ++i) {
-				oled.drawPage(buf + i * width, startPage + i, offset, glyphWidth);
-			}
+			int glyphWidth = this->glyphWidth(s);
+			oled.drawPages_P(glyphs + s * width * pages, startPage, pages, offset, glyphWidth, width);
 			return glyphWidth;
 		}
+
+		int glyphWidth(int s) const {
+			return (pgm_read_byte(&d2s[s]) & 0b10000000) ? width/2 : width;
+		}
 		uint8_t width;
 		uint8_t pages;
 
 	private:
 		SSD1306 & oled;
-		SSegmentRender render;
-		uint8_t * buf = nullptr;
+		const uint8_t * glyphs;
 };
 
 class NumberStr {
 	public:
 		NumberStr() = delete;
-		NumberStr(NumberPrinter & p, NumberPrinter & l, uint8_t x, uint8_t topPage, uint8_t width)
-			: printer(p), label(l), x(x), topPage(topPage), width(width)
+		// With decimals the value is in fixed point, shown with at least
+		// one digit before the point
+		NumberStr(NumberPrinter & p, NumberPrinter & l, uint8_t x, uint8_t topPage, uint8_t width, uint8_t decimals = 0)
+			: printer(p), label(l), x(x), topPage(topPage), width(width), decimals(decimals)
 		{}
 
+			// Only glyphs which differ from the drawn number are sent. As long
+			// as the glyph widths match the layout stays put; from the first
+			// width change on the old tail is cleared and drawn again.
 			void setNumber(int16_t value, uint8_t lblChar) 
 			{
-				printer.clear(x, topPage, width);
-
-				constexpr int len = 7;
-				uint8_t str[len] = {0, };
+				uint8_t cells[len];
+				uint8_t n = layout(value, cells);
 				uint8_t x_offset = 0;
+				uint8_t i = 0;
+
+				if(lastLabel == none) {
+					printer.clear(x, topPage, width);
+				} else {
+					uint8_t old[len];
+					uint8_t oldN = layout(lastValue, old);
+
+					for(; i < n && i < oldN && advance(cells[i]) == advance(old[i]); ++i) {
+						if(cells[i] != old[i]) {
+							printChar(cells[i], x_offset);
+						}
+						x_offset += advance(cells[i]);
+					}
+
+					if(i == n && i == oldN) {
+						if(lblChar != lastLabel) {
+							if(label.glyphWidth(lblChar) < label.glyphWidth(lastLabel)) {
+								printer.clear(labelX(x_offset), topPage, label.glyphWidth(lastLabel));
+							}
+							printLabel(lblChar, x_offset);
+						}
+						lastValue = value;
+						lastLabel = lblChar;
+						return;
+					}
+
+					uint8_t oldEnd = x_offset;
+					for(uint8_t j = i; j < oldN; ++j) {
+						oldEnd += advance(old[j]);
+					}
+					oldEnd += printer.width/4 + label.glyphWidth(lastLabel);
+					printer.clear(x + x_offset, topPage, oldEnd - x_offset);
+				}
+
+				for(; i < n; ++i) {
+					x_offset += printChar(cells[i], x_offset);
+				}
+				printLabel(lblChar, x_offset);
+				lastValue = value;
+				lastLabel = lblChar;
+			}
+
+			// The panel was cleared behind our back
+			void invalidate()
+			{
+				lastLabel = none;
+			}
+
+	private:
+			static constexpr int len = 7;
+			static constexpr uint8_t none = 0xFF;
+			static constexpr uint8_t point = 16;
+
+			// Glyph codes of the number, most significant first
+			uint8_t layout(int16_t value, uint8_t * cells)
+			{
+				uint8_t str[len];
 				uint8_t sign = 0;
 				if(value < 0) {
 					value =-value;
 					sign = 1;
 				}
 				uint8_t i = 0;
-				while(value > 0) {
+				for(uint8_t digits = 0; value > 0 || (decimals && digits <= decimals); ++digits) {
+					if(decimals && digits == decimals) {
+						str[i++] = point;
+					}
 					str[i++] = value%10;
 					value /= 10;
 				}
 				if(sign) {
-					str[i++] = '-';
+					str[i++] = 10; // symbol of '-'
 				}
-
-				while(i--) {
-					int c;
-					if(str[i] >= 0 && str[i] <= 9) {
-						c = str[i];
-					} else {
-						c = 10; // symbol of '-'
-					}
-					x_offset += printChar(c, x_offset);
+				for(uint8_t j = 0; j < i; ++j) {
+					cells[j] = str[i - j - 1];
 				}
-				label.print(lblChar, x + x_offset + printer.width/4, topPage + printer.pages - label.pages);
+				return i;
 			}
-	private:
-			int	printChar(int c, int offset) {
-				int charWidth = printer.print(c, offset + x, topPage);
+
+			int distance()
+			{
 				int distance = printer.width/3;
 				if(distance < 2) {
 					distance = 2;
 				}
-				return charWidth + distance;
+				return distance;
 			}
+
+			int advance(int c)
+			{
+				return printer.glyphWidth(c) + distance();
+			}
+
+			int	printChar(int c, int offset) {
+				int charWidth = printer.print(c, offset + x, topPage);
+				return charWidth + distance();
+			}
+
+			uint8_t labelX(uint8_t x_offset)
+			{
+				return x + x_offset + printer.width/4;
+			}
+
+			void printLabel(uint8_t lblChar, uint8_t x_offset)
+			{
+				label.print(lblChar, labelX(x_offset), topPage + printer.pages - label.pages);
+			}
+
 			NumberPrinter & printer;
 			NumberPrinter & label;
 			uint8_t x;
 			uint8_t topPage;
 			uint8_t width;
+			uint8_t decimals;
+			int16_t lastValue = 0;
+			uint8_t lastLabel = none;
 };
 
 
+// Sample history in three tiers. Tier 0 keeps the logged samples packed
+// (see below), tiers 1 and 2 the CO2 mean, minimum and maximum of six hours
+// and of a day. Row 0 is CO2 in ppm in every tier. A zero marks an empty
+// slot. The samples live in the EEPROM; RAM only holds the block being
+// filled and the newest slot of each coarse tier, which the background
+// writer mirrors.
 class DataArray {
 public:
-	DataArray ()
+	static constexpr uint8_t tiers = 3;
+
+	// Walks one row of a tier from a slot towards the newest one
+	class Reader {
+	public:
+		uint16_t next()
+		{
+			if(empty) {
+				--empty;
+				return 0;
+			}
+			if(tier) {
+				uint16_t v = static_cast<uint16_t>(arr.coarse(tier, index, row)) << coarseShift;
+				if(++index == arr.tier[tier].first + arr.tier[tier].size) {
+					index = arr.tier[tier].first;
+				}
+				return v;
+			}
+			uint16_t v = row == 0 ? current << 1 : current;
+			if(++pos >= arr.count(index)) {
+				pos = 0;
+				if(++index == blockCount) {
+					index = 0;
+				}
+				arr.key(row, index, at, ref, current);
+			} else {
+				arr.step(row, index, at, ref, current);
+			}
+			return v;
+		}
+
+	private:
+		friend class DataArray;
+		Reader(const DataArray & arr, uint8_t tier, uint8_t row)
+			: arr(arr), tier(tier), row(row)
+		{}
+
+		const DataArray & arr;
+		uint8_t tier;
+		uint8_t row;
+		// slots before the first sample
+		uint8_t empty = 0;
+		// block in tier 0, slot index in the others
+		uint8_t index = 0;
+		uint8_t pos = 0;
+		// bit offset of the next code in the tier 0 block
+		uint8_t at = 0;
+		uint16_t ref = 0;
+		uint16_t current = 0;
+	};
+
+	void addValue(uint16_t co2, uint8_t v1, uint8_t v2)
 	{
-		memset(data, 0, width*row);
+		// the open block and the staged coarse slots move on to other
+		// addresses below, the last pass has to have written them
+		while(Eeprom::busy());
+		blank = 0;
+
+		uint16_t v[row] = {co2, v1, v2};
+		uint16_t old[row];
+		for(uint8_t r = 0; r < row; ++r) {
+			old[r] = get(0, r, 0);
+		}
+		uint8_t shown = stored < samples ? stored : samples;
+		append(co2, v1, v2);
+		// a refilled block may take more than the oldest sample along, the
+		// view then changed beyond a shift by one slot
+		uint8_t dropped = stored < samples && stored <= shown;
+		for(uint8_t r = 0; r < row; ++r) {
+			if(dropped) {
+				tier[0].maxValue[r] = scan(0, r, 1);
+				tier[0].minValue[r] = scan(0, r, 0);
+			} else {
+				track(0, r, get(0, r, samples - 1), old[r]);
+			}
+		}
+		tier[0].revision += 1 + dropped;
+
+		// finished buckets roll over into the next coarser tier
+		if(sixHours.add(co2, co2, co2) == samplesPerSixHours) {
+			sixHours.take(v);
+			push(1, v);
+			if(day.add(v[0], v[1], v[2]) == sixHoursPerDay) {
+				day.take(v);
+				push(2, v);
+			}
+		}
 	}
 
-	void addValue(uint8_t v0, uint8_t v1, uint8_t v2)
+	// Starts writing the history to EEPROM in the background, a pass
+	// still running starts over. Call after each addValue().
+	void save()
 	{
-		uint8_t index = cur % width;
-		data[index][0] = v0;
-		data[index][1] = v1;
-		data[index][2] = v2;
-		++cur;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			checkpoint = {layoutVersion, ++seq, head, open.count, stored,
+				{tier[1].pos, tier[2].pos}, {sixHours.ticks, day.ticks}, 0};
+			checkpoint.crc = crc(checkpoint);
+			regions[tiers].address = checkpointAddress + slot * sizeof(Checkpoint);
+			Eeprom::sync(regions, tiers + 1);
+		}
+		if(++slot == checkpointSlots) {
+			slot = 0;
+		}
 	}
 
-	uint8_t getMax(int row)
+	// Loads the newest valid checkpoint. Without one the history starts
+	// empty and the blocks and coarse slots are cleared in the background.
+	// Only the checkpoints and the newest slots are read, so this is quick
+	// enough to run before the display comes up; the buckets, extremes and
+	// encoder state are rebuilt from the decoded samples.
+	void restore()
 	{
-		uint8_t max = 0;
-		for(int i = 0; i < width; ++i) {
-			if(data[i][row] > max) {
-				max = data[i][row];
+		Checkpoint c = {};
+		uint8_t found = 0;
+		for(uint8_t i = 0; i < checkpointSlots; ++i) {
+			Checkpoint r;
+			eeprom_read_block(&r, reinterpret_cast<const void *>(checkpointAddress + i * sizeof(r)), sizeof(r));
+			if(valid(r) && (!found || static_cast<int8_t>(r.seq - c.seq) > 0)) {
+				c = r;
+				slot = i + 1 == checkpointSlots ? 0 : i + 1;
+				found = 1;
+			}
+		}
+		if(!found) {
+			blank = 1;
+			Eeprom::sync(&cleared, 1);
+			return;
+		}
+
+		seq = c.seq;
+		head = c.head;
+		tier[1].pos = c.pos[0];
+		tier[2].pos = c.pos[1];
+		regions[0].address = blockAddress(head);
+		eeprom_read_block(&open, reinterpret_cast<const void *>(regions[0].address), sizeof(open));
+		for(uint8_t t = 1; t < tiers; ++t) {
+			regions[t].address = coarseAddress + tier[t].newest() * row;
+			eeprom_read_block(newest[t - 1], reinterpret_cast<const void *>(regions[t].address), row);
+		}
+		// A pass cut short may have written samples the checkpoint does not
+		// count yet: more of the open block, or the next block already
+		// restarted. That one then lost its old samples.
+		open.count = c.fill;
+		stored = 0;
+		for(uint8_t b = 0; b < blockCount; ++b) {
+			if(count(b) > blockSamples) {
+				drop(b);
+			}
+			stored += count(b);
+		}
+		if(stored != c.stored) {
+			uint8_t oldest = head + 1 == blockCount ? 0 : head + 1;
+			stored -= count(oldest);
+			drop(oldest);
+		}
+		for(uint8_t r = 0; r < row; ++r) {
+			Reader it = begin(0, r, samples - 1);
+			last[r] = it.ref;
+			tail[r] = it.at;
+			// codes past the checkpoint would mix with the next ones
+			uint8_t * area = r ? open.small[r - 1] : open.co2;
+			for(uint8_t i = tail[r] / 8; i < (r ? smallBlockBytes : co2BlockBytes); ++i) {
+				area[i] &= i == tail[r] / 8 ? (1 << tail[r] % 8) - 1 : 0;
+			}
+		}
+
+		Reader co2 = begin(0, 0, samples - c.ticks[0]);
+		for(uint8_t i = c.ticks[0]; i; --i) {
+			uint16_t v = co2.next();
+			sixHours.add(v, v, v);
+		}
+		Reader mean = begin(1, 0, sixHourSlots - c.ticks[1]);
+		Reader low = begin(1, 1, sixHourSlots - c.ticks[1]);
+		Reader high = begin(1, 2, sixHourSlots - c.ticks[1]);
+		for(uint8_t i = c.ticks[1]; i; --i) {
+			day.add(mean.next(), low.next(), high.next());
+		}
+
+		for(uint8_t t = 0; t < tiers; ++t) {
+			for(uint8_t r = 0; r < row; ++r) {
+				tier[t].maxValue[r] = scan(t, r, 1);
+				tier[t].minValue[r] = scan(t, r, 0);
 			}
 		}
-		return max;
 	}
-	
-	uint8_t getMin(int row)
+
+	uint8_t slots(uint8_t t) const
 	{
-		uint8_t min = 0xFF;
-		for(int i = 0; i < width; ++i) {
-			if(data[i][row] != 0 && data[i][row] < min) {
-				min = data[i][row];
+		return t == 0 ? samples : tier[t].size;
+	}
+
+	// Slot 0 is the oldest one
+	Reader begin(uint8_t t, uint8_t row, uint8_t slot = 0) const
+	{
+		Reader it(*this, t, row);
+		if(t) {
+			it.index = tier[t].index(slot);
+			return it;
+		}
+
+		uint8_t age = samples - 1 - slot;
+		if(age >= stored) {
+			it.empty = samples - stored - slot;
+			age = stored - 1;
+		}
+		if(stored) {
+			uint8_t b = head;
+			while(age >= count(b)) {
+				age -= count(b);
+				b = b ? b - 1 : blockCount - 1;
+			}
+			it.index = b;
+			it.pos = count(b) - 1 - age;
+			key(row, b, it.at, it.ref, it.current);
+			for(uint8_t i = 0; i < it.pos; ++i) {
+				step(row, b, it.at, it.ref, it.current);
 			}
 		}
-		return min == 0xFF ? 0 : min;
+		return it;
+	}
+
+	uint16_t get(uint8_t t, uint8_t row, uint8_t slot) const
+	{
+		return begin(t, row, slot).next();
+	}
+
+	uint16_t getMax(uint8_t t, uint8_t row) const
+	{
+		return tier[t].maxValue[row];
+	}
+
+	uint16_t getMin(uint8_t t, uint8_t row) const
+	{
+		return tier[t].minValue[row];
 	}
 
-	uint8_t getLast(int row, int8_t offset)
+	// Changes whenever a slot of the tier is written, by one for each
+	// sample appended; more when older slots changed too.
+	uint8_t revision(uint8_t t) const
 	{
-		uint16_t ind = cur+offset;
-		return data[ind % width][row];
+		return tier[t].revision;
 	}
 
 private:
-	static constexpr uint8_t width = 128;
 	static constexpr uint8_t row = 3;
-	uint8_t cur = 0;
-	uint8_t data[width][row];
+	// 6 min samples for 12.8 h, 6 h aggregates for a week, days for four
+	static constexpr uint8_t samples = 128;
+	static constexpr uint8_t samplesPerSixHours = 60;
+	static constexpr uint8_t sixHoursPerDay = 4;
+	static constexpr uint8_t sixHourSlots = 28;
+	static constexpr uint8_t daySlots = 28;
+
+	// Tier 0 is split into blocks of up to 16 samples. A block starts with
+	// a key sample: CO2 in 12 bits of 2 ppm, temperature and humidity in a
+	// byte each. The samples after it are codes packed into the area of
+	// their row: a 6 bit CO2 delta of -30..31, a 2 bit temperature or
+	// humidity delta of -1..1, or an escape code followed by the whole
+	// value, so nothing is lost. A sample whose codes do not fit the areas
+	// any more starts the next block. Samples without a CO2 reading keep
+	// the last one as reference, the key flags them in its top bit. One
+	// block more than the view needs is kept so a block can be refilled
+	// while the view stays complete, short blocks eat into that.
+	static constexpr uint8_t blockSamples = 16;
+	static constexpr uint8_t blockCount = samples / blockSamples + 1;
+	// room for two CO2 escapes and one of each other row at full length
+	static constexpr uint8_t co2BlockBytes = 2 + ((blockSamples - 1) * 6 + 2 * 12 + 7) / 8;
+	static constexpr uint8_t smallBlockBytes = 1 + ((blockSamples - 1) * 2 + 8 + 7) / 8;
+	// CO2 codes of a sample without reading and of a 12 bit value
+	static constexpr uint8_t co2Missing = 0x20;
+	static constexpr uint8_t co2Escape = 0x21;
+	static constexpr uint8_t keyMissing = 0x80;
+	// temperature and humidity code of an 8 bit value
+	static constexpr uint8_t smallEscape = 0x02;
+
+	// Coarse tiers keep bytes of 32 ppm, up to 8160 ppm
+	static constexpr uint8_t coarseShift = 5;
+
+	struct Block {
+		// samples in the block, the key included
+		uint8_t count;
+		uint8_t co2[co2BlockBytes];
+		// temperature and humidity
+		uint8_t small[row - 1][smallBlockBytes];
+	};
+
+	// The EEPROM starts with the blocks, then come the coarse slots with
+	// the rows of a slot next to each other, then the checkpoints.
+	static constexpr uint16_t coarseAddress = blockCount * sizeof(Block);
+	static constexpr uint16_t checkpointAddress = coarseAddress + (sixHourSlots + daySlots) * row;
+
+	static constexpr uint16_t blockAddress(uint8_t block)
+	{
+		return block * sizeof(Block);
+	}
+
+	struct Tier {
+		uint8_t first;
+		uint8_t size;
+		uint8_t pos;
+		uint8_t revision;
+		uint16_t maxValue[row];
+		uint16_t minValue[row];
+
+		uint8_t index(uint8_t slot) const
+		{
+			uint8_t i = pos + slot;
+			if(i >= size) {
+				i -= size;
+			}
+			return first + i;
+		}
+
+		// slot written by the last push
+		uint8_t newest() const
+		{
+			return first + (pos ? pos : size) - 1;
+		}
+	};
+
+	// Running mean, minimum and maximum of the values rolled into it
+	struct Bucket {
+		uint32_t sum;
+		uint8_t count;
+		uint8_t ticks;
+		uint16_t min;
+		uint16_t max;
+
+		// Returns the number of adds since the last take()
+		uint8_t add(uint16_t mean, uint16_t low, uint16_t high)
+		{
+			++ticks;
+			if(mean) {
+				sum += mean;
+				if(!count || low < min) {
+					min = low;
+				}
+				if(!count || high > max) {
+					max = high;
+				}
+				++count;
+			}
+			return ticks;
+		}
+
+		void take(uint16_t * v)
+		{
+			v[0] = count ? (sum + count/2) / count : 0;
+			v[1] = count ? min : 0;
+			v[2] = count ? max : 0;
+			*this = Bucket();
+		}
+	};
+
+	void append(uint16_t co2, uint8_t v1, uint8_t v2)
+	{
+		uint16_t units = (co2 + 1) >> 1;
+		if(units > 0x0FFF) {
+			units = 0x0FFF;
+		}
+
+		// the sample as codes to its predecessor
+		uint32_t code[row];
+		uint8_t width[row];
+		int16_t d = units - last[0];
+		if(!units) {
+			code[0] = co2Missing;
+			width[0] = 6;
+		} else if(d >= -30 && d <= 31) {
+			code[0] = d & 0x3F;
+			width[0] = 6;
+		} else {
+			code[0] = co2Escape | static_cast<uint32_t>(units) << 6;
+			width[0] = 18;
+		}
+		uint8_t fits = tail[0] + width[0] <= co2BlockBytes * 8;
+		const uint8_t v[row] = {0, v1, v2};
+		for(uint8_t r = 1; r < row; ++r) {
+			d = v[r] - last[r];
+			if(d >= -1 && d <= 1) {
+				code[r] = d & 0x03;
+				width[r] = 2;
+			} else {
+				code[r] = smallEscape | v[r] << 2;
+				width[r] = 10;
+			}
+			if(tail[r] + width[r] > smallBlockBytes * 8) {
+				fits = 0;
+			}
+		}
+
+		if(open.count == blockSamples || (open.count && !fits)) {
+			if(++head == blockCount) {
+				head = 0;
+			}
+			regions[0].address = blockAddress(head);
+			stored -= Eeprom::read(regions[0].address);
+			memset(&open, 0, sizeof(open));
+		}
+
+		if(open.count == 0) {
+			if(units) {
+				last[0] = units;
+			}
+			open.co2[0] = last[0];
+			open.co2[1] = (last[0] >> 8) | (units ? 0 : keyMissing);
+			tail[0] = 16;
+			for(uint8_t r = 1; r < row; ++r) {
+				open.small[r - 1][0] = last[r] = v[r];
+				tail[r] = 8;
+			}
+		} else {
+			if(units) {
+				last[0] = units;
+			}
+			put(open.co2, tail[0], code[0]);
+			tail[0] += width[0];
+			for(uint8_t r = 1; r < row; ++r) {
+				last[r] = v[r];
+				put(open.small[r - 1], tail[r], code[r]);
+				tail[r] += width[r];
+			}
+		}
+		++open.count;
+		++stored;
+	}
+
+	// Codes are packed from the least significant bit on
+	static void put(uint8_t * area, uint8_t at, uint32_t code)
+	{
+		uint32_t bits = code << (at % 8);
+		for(uint8_t i = at / 8; bits; ++i, bits >>= 8) {
+			area[i] |= bits;
+		}
+	}
+
+	uint16_t take(uint8_t block, uint8_t r, uint8_t at, uint8_t width) const
+	{
+		uint8_t first = at / 8;
+		uint8_t end = (at + width + 7) / 8;
+		// a damaged block from the EEPROM must not read past its areas
+		if(end > (r ? smallBlockBytes : co2BlockBytes)) {
+			return 0;
+		}
+		uint8_t area = r ? offsetof(Block, small) + (r - 1) * smallBlockBytes : offsetof(Block, co2);
+		uint32_t bits = 0;
+		for(uint8_t i = end; i > first; --i) {
+			bits = bits << 8 | blockByte(block, area + i - 1);
+		}
+		return (bits >> (at % 8)) & ((1UL << width) - 1);
+	}
+
+	// Byte of a tier 0 block, the open one is read from RAM
+	uint8_t blockByte(uint8_t block, uint8_t offset) const
+	{
+		if(block == head) {
+			return reinterpret_cast<const uint8_t *>(&open)[offset];
+		}
+		return Eeprom::read(blockAddress(block) + offset);
+	}
+
+	uint8_t count(uint8_t block) const
+	{
+		return blockByte(block, offsetof(Block, count));
+	}
+
+	// Empties a block in the EEPROM, only while no pass runs
+	void drop(uint8_t block)
+	{
+		eeprom_update_byte(reinterpret_cast<uint8_t *>(blockAddress(block)), 0);
+	}
+
+	// Coarse slot byte, the newest slot of a tier is read from RAM
+	uint8_t coarse(uint8_t t, uint8_t index, uint8_t r) const
+	{
+		if(blank) {
+			return 0;
+		}
+		if(index == tier[t].newest()) {
+			return newest[t - 1][r];
+		}
+		return Eeprom::read(coarseAddress + index * row + r);
+	}
+
+	// Loads the key sample of a tier 0 block into a reader state; current
+	// is zero for a missing reading while ref keeps the last one
+	void key(uint8_t r, uint8_t block, uint8_t & at, uint16_t & ref, uint16_t & current) const
+	{
+		if(r == 0) {
+			uint8_t high = blockByte(block, offsetof(Block, co2) + 1);
+			ref = blockByte(block, offsetof(Block, co2)) | (high & 0x0F) << 8;
+			current = (high & keyMissing) ? 0 : ref;
+			at = 16;
+		} else {
+			ref = current = blockByte(block, offsetof(Block, small) + (r - 1) * smallBlockBytes);
+			at = 8;
+		}
+	}
+
+	// Applies the code at bit at of a tier 0 block and moves past it
+	void step(uint8_t r, uint8_t block, uint8_t & at, uint16_t & ref, uint16_t & current) const
+	{
+		if(r == 0) {
+			uint8_t code = take(block, r, at, 6);
+			at += 6;
+			if(code == co2Missing) {
+				current = 0;
+				return;
+			}
+			if(code == co2Escape) {
+				ref = take(block, r, at, 12);
+				at += 12;
+			} else {
+				ref += static_cast<int8_t>(code << 2) >> 2;
+			}
+		} else {
+			uint8_t code = take(block, r, at, 2);
+			at += 2;
+			if(code == smallEscape) {
+				ref = take(block, r, at, 8);
+				at += 8;
+			} else {
+				ref += static_cast<int8_t>(code << 6) >> 6;
+			}
+		}
+		current = ref;
+	}
+
+	void push(uint8_t t, const uint16_t * v)
+	{
+		Tier & ti = tier[t];
+		uint8_t index = ti.first + ti.pos;
+		uint16_t old[row];
+		for(uint8_t r = 0; r < row; ++r) {
+			old[r] = static_cast<uint16_t>(coarse(t, index, r)) << coarseShift;
+			uint16_t value = (v[r] + (1 << (coarseShift - 1))) >> coarseShift;
+			newest[t - 1][r] = value > 0xFF ? 0xFF : value;
+		}
+		regions[t].address = coarseAddress + index * row;
+		if(++ti.pos == ti.size) {
+			ti.pos = 0;
+		}
+		for(uint8_t r = 0; r < row; ++r) {
+			track(t, r, static_cast<uint16_t>(newest[t - 1][r]) << coarseShift, old[r]);
+		}
+		++ti.revision;
+	}
+
+	// The extremes only need a rescan when the evicted value was the one
+	// holding them and the new value does not replace it.
+	void track(uint8_t t, uint8_t r, uint16_t value, uint16_t old)
+	{
+		Tier & ti = tier[t];
+		if(value >= ti.maxValue[r]) {
+			ti.maxValue[r] = value;
+		} else if(old == ti.maxValue[r]) {
+			ti.maxValue[r] = scan(t, r, 1);
+		}
+
+		// Zero marks an empty slot and never counts as a minimum.
+		if(value != 0 && (ti.minValue[r] == 0 || value <= ti.minValue[r])) {
+			ti.minValue[r] = value;
+		} else if(old != 0 && old == ti.minValue[r]) {
+			ti.minValue[r] = scan(t, r, 0);
+		}
+	}
+
+	uint16_t scan(uint8_t t, uint8_t r, uint8_t findMax) const
+	{
+		uint16_t max = 0;
+		uint16_t min = 0xFFFF;
+		Reader it = begin(t, r);
+		for(uint8_t i = slots(t); i; --i) {
+			uint16_t v = it.next();
+			if(v > max) {
+				max = v;
+			}
+			if(v != 0 && v < min) {
+				min = v;
+			}
+		}
+		return findMax ? max : min == 0xFFFF ? 0 : min;
+	}
+
+	Tier tier[tiers] = {
+		{},
+		{0, sixHourSlots},
+		{sixHourSlots, daySlots},
+	};
+	Bucket sixHours = {};
+	Bucket day = {};
+
+	// the block at head, samples are appended here
+	Block open = {};
+	// the newest slot of tiers 1 and 2
+	uint8_t newest[tiers - 1][row] = {};
+	uint8_t head = 0;
+	// samples in all blocks
+	uint8_t stored = 0;
+	// values the encoder continues from, CO2 in 2 ppm units
+	uint16_t last[row] = {};
+	// bit offset of the next code in the areas of the head block
+	uint8_t tail[row] = {};
+
+	// Where the stored samples stand. The rest of the EEPROM is a ring of
+	// these, each pass writes the next one after the samples, so a slot
+	// sees one write in checkpointSlots. A torn write fails the CRC and
+	// the one before it is used.
+	struct Checkpoint {
+		uint8_t version;
+		uint8_t seq;
+		uint8_t head;
+		uint8_t fill;
+		uint8_t stored;
+		uint8_t pos[tiers - 1];
+		uint8_t ticks[tiers - 1];
+		uint8_t crc;
+	};
+	// bump when the EEPROM layout or Checkpoint change
+	static constexpr uint8_t layoutVersion = 3;
+	static constexpr uint8_t checkpointSlots = (E2END + 1 - checkpointAddress) / sizeof(Checkpoint);
+	static_assert(checkpointSlots >= 2, "history does not fit the EEPROM");
+
+	static uint8_t crc(const Checkpoint & c)
+	{
+		const uint8_t * p = reinterpret_cast<const uint8_t *>(&c);
+		uint8_t crc = 0;
+		for(uint8_t i = 0; i < sizeof(c) - 1; ++i) {
+			crc = _crc8_ccitt_update(crc, p[i]);
+		}
+		return crc;
+	}
+
+	static uint8_t valid(const Checkpoint & c)
+	{
+		return c.version == layoutVersion && c.crc == crc(c)
+			&& c.head < blockCount && c.fill && c.fill <= blockSamples && c.stored <= blockCount * blockSamples
+			&& c.pos[0] < sixHourSlots && c.pos[1] < daySlots
+			&& c.ticks[0] < samplesPerSixHours && c.ticks[1] < sixHoursPerDay;
+	}
+
+	// Read by the EEPROM interrupt, only changed when a pass starts
+	Checkpoint checkpoint = {};
+	EepromRegion regions[tiers + 1] = {
+		{blockAddress(0), &open, sizeof(open)},
+		{coarseAddress + (sixHourSlots - 1) * row, newest[0], row},
+		{coarseAddress + (sixHourSlots + daySlots - 1) * row, newest[1], row},
+		{0, &checkpoint, sizeof(checkpoint)},
+	};
+	uint8_t seq = 0;
+	uint8_t slot = 0;
+
+	// Blocks and coarse slots of a blank EEPROM or an older layout, zeroed
+	// by the pass restore() starts. Until the first addValue() has waited
+	// for it the coarse slots read as empty; the blocks are not read while
+	// stored is zero.
+	static const EepromRegion cleared;
+	uint8_t blank = 0;
 };
 
+const EepromRegion DataArray::cleared = {0, 0, DataArray::checkpointAddress};
+
+
+// The main loop polls the sensors and redraws the screen in slices of this
+constexpr uint8_t pollSliceMs = 10;
 
 class ChartWidget
 {
@@ -296,167 +1019,334 @@ public:
 		, arr(arr)
 	{}
 
-	void draw(uint8_t cursorOffset)
+	// Shows the slots of one history tier stretched over the 128 columns
+	void setTier(uint8_t t)
+	{
+		tier = t;
+	}
+
+	uint8_t getTier() const
 	{
-		for(int i = 0; i < 128; ++i) {
-			drawColumn(i, cursorOffset == i);
+		return tier;
+	}
+
+	uint8_t slotAt(uint8_t column) const
+	{
+		return (static_cast<uint16_t>(column) * arr.slots(tier)) >> 7;
+	}
+
+	uint16_t valueAt(uint8_t row, uint8_t column) const
+	{
+		return arr.get(tier, row, slotAt(column));
+	}
+
+	// Redraws every column only when forced or when the scale changed. A
+	// single new sample scrolls the plot on the panel and draws just the
+	// newest columns; a cursor move repaints just the two columns.
+	//
+	// The panel takes a while for each one-column scroll, so a scroll is
+	// spread over several calls, one per poll slice, while busy() is set.
+	void draw(uint8_t cursorOffset, int8_t force)
+	{
+#if SSD1306_CONTENT_SCROLL
+		force |= pendingForce;
+		pendingForce = 0;
+#endif
+		if(tier != drawnTier) {
+			drawnTier = tier;
+			force = 1;
+		}
+		uint8_t added = arr.revision(tier) - drawnRevision;
+		drawnRevision = arr.revision(tier);
+
+		if(force || added) {
+#if SSD1306_CONTENT_SCROLL
+			uint8_t rescaled = updateScale();
+			// columns per slot, scrolling needs a whole number
+			uint8_t step = 128 / arr.slots(tier);
+			uint8_t scroll = !force && added == 1 && !rescaled && !busy()
+				&& step * arr.slots(tier) == 128;
+			scrolls = scroll ? step : 0;
+			shifted = 0;
+#else
+			updateScale();
+			uint8_t scroll = 0;
+#endif
+			if(!scroll) {
+				drawColumns(0, 128, cursorOffset);
+				drawnCursor = cursorOffset;
+				return;
+			}
+		}
+
+		// column showing the cursor highlight on the panel
+		uint8_t stale = drawnCursor;
+#if SSD1306_CONTENT_SCROLL
+		if(scrolls) {
+			oled.scrollLeft(1, 3*pages, 0, 128);
+			--scrolls;
+			++shifted;
+			settle = scrollSlices;
+			return;
+		}
+		if(shifted) {
+			drawColumns(128 - shifted, shifted, cursorOffset);
+			// the highlight moved along, out of the view from the left
+			stale -= shifted;
+			shifted = 0;
+		}
+#endif
+		if(stale != cursorOffset) {
+			if(stale < 128) {
+				drawColumns(stale, 1, cursorOffset);
+			}
+			drawColumns(cursorOffset, 1, cursorOffset);
 		}
+		drawnCursor = cursorOffset;
 	}
 
-	void drawColumn(uint8_t ind, uint8_t cursor)
+	// Counts down the poll slices after a one-column scroll, nothing may
+	// be sent to the panel meanwhile. A forced draw is kept for later.
+	uint8_t settling(int8_t force)
 	{
-		constexpr uint8_t pages = 2;
-		uint8_t pb[pages];
-		int needDraw = 0;
+#if SSD1306_CONTENT_SCROLL
+		if(settle && --settle) {
+			pendingForce |= force;
+			return 1;
+		}
+#endif
+		return 0;
+	}
 
-		for(int r = 0; r < 3; ++r) {
-			memset(pb, 0, pages);
+	// A scroll is still under way, draw() wants to be called again
+	uint8_t busy() const
+	{
+#if SSD1306_CONTENT_SCROLL
+		return scrolls || shifted;
+#else
+		return 0;
+#endif
+	}
 
-			uint8_t max = arr.getMax(r);
-			uint8_t min = arr.getMin(r);
+	// Latches the vertical range of every series; drawColumns() uses the
+	// values from the last call so a frame is drawn with a single scale.
+	// Returns non-zero when any series got a different scale.
+	//
+	// A row is (val - min) * 15 / (max - min). The division is replaced by
+	// a 16x16 bit multiplication with factor = ceil(15 * 2^k / range),
+	// k as large as the factor allows, and a shift by k. That is never
+	// low and at most one row high; comparing row * range against
+	// (val - min) * 15 takes the extra row back, so every val in range
+	// gets exactly the row of the division.
+	uint8_t updateScale()
+	{
+		uint8_t changed = 0;
+		for(uint8_t r = 0; r < 3; ++r) {
+			uint16_t max = arr.getMax(tier, r);
+			uint16_t min = arr.getMin(tier, r);
 			if(max == min) {
-				max++;
+				if(max < 0xFFFF) {
+					max++;
+				}
 				if(min>0) {
 					min--;
 				}
 			}
+			uint16_t range = max - min;
+			uint8_t shift = 12;
+			while((0xFFFFUL * range) >> (shift + 1) >= pages*8-1) {
+				++shift;
+			}
+			uint16_t factor = ((static_cast<uint32_t>(pages*8-1) << shift) + range - 1) / range;
 
-			uint8_t val = arr.getLast(r, ind);
-			uint16_t pt = ((val - min) * (pages*8-1))/(max-min);
-			needDraw |= val;
+			Scale & s = scale[r];
+			if(s.min != min || s.range != range) {
+				changed = 1;
+			}
+			s.min = min;
+			s.range = range;
+			s.shift = shift;
+			s.factor = factor;
+			// Empty samples sit below min and only reach the bottom row
+			// while min is close to zero.
+			s.zeroVisible = static_cast<uint32_t>(min) * (pages*8-1) < static_cast<uint16_t>(max - min);
+		}
+		return changed;
+	}
 
+	// Renders the columns in chunks that line up with the display's dirty
+	// tracking segments. Every series of a chunk goes out as one block
+	// write, and the next block is built while the previous one is still
+	// on the bus. Each series is read front to back with one reader.
+	void drawColumns(uint8_t first, uint8_t count, uint8_t cursor)
+	{
+		uint8_t buffers[2][pages * chunk];
+		uint8_t which = 0;
+		uint8_t end = first + count;
+
+		uint8_t slot = slotAt(first);
+		DataArray::Reader readers[3] = {
+			arr.begin(tier, 0, slot),
+			arr.begin(tier, 1, slot),
+			arr.begin(tier, 2, slot),
+		};
+		uint16_t values[3];
+		// slot the readers return next
+		uint8_t next = slot;
+
+		for(uint8_t x = first; x != end; ) {
+			uint8_t n = chunk - x % chunk;
+			if(n > end - x) {
+				n = end - x;
+			}
 
+			uint16_t needDraw = 0;
+			for(uint8_t r = 0; r < 3; ++r) {
+				uint8_t * pb = buffers[which];
+				memset(pb, 0, pages * n);
 
-			for(uint8_t i = 0; i < pages; ++i) {
-				if( (pt >= i * 8) && (pt < static_cast<uint8_t>(((i+1)*8))) ) {
-					uint16_t pattern = 0b10000000;
-					pattern >>= pt - i * 8;
-					pb[pages - i - 1] |= pattern;
+				uint8_t at = next;
+				for(uint8_t c = 0; c < n; ++c) {
+					// coarse tiers spread a slot over several columns
+					for(slot = slotAt(x + c); at <= slot; ++at) {
+						values[r] = readers[r].next();
+					}
+					uint16_t val = values[r];
+					if(val) {
+						needDraw |= 1 << c;
+					}
+					// columns without data stay blank, even under the cursor
+					if(!(needDraw & (1 << c))) {
+						continue;
+					}
+
+					const Scale & s = scale[r];
+					uint8_t pt;
+					if(val >= s.min) {
+						uint16_t steps = val - s.min;
+						pt = (static_cast<uint32_t>(steps) * s.factor) >> s.shift;
+						if(static_cast<uint32_t>(pt) * s.range > static_cast<uint32_t>(steps) * (pages*8-1)) {
+							--pt;
+						}
+					} else {
+						pt = s.zeroVisible ? 0 : 0xFF;
+					}
+
+					// the bottom page of the series holds the lowest values
+					if(pt < pages * 8) {
+						pb[(pages - 1 - pt / 8) * n + c] = 0b10000000 >> (pt % 8);
+					}
+					if(x + c == cursor) {
+						for(uint8_t i = 0; i < pages; ++i) {
+							pb[i * n + c] = ~pb[i * n + c];
+						}
+					}
 				}
-			}
 
-			if(needDraw) {
-				for(int i = 0; i < pages; ++i) {
-					uint8_t p = cursor ? ~pb[i] : pb[i];
-					oled.drawPage(&p, 1 + i + r*pages, ind, 1);
+				// the other buffer may still be in flight
+				oled.flush();
+				oled.drawPages(pb, 1 + r*pages, pages, x, n, n);
+				which ^= 1;
+				if(r == 2) {
+					next = at;
 				}
 			}
+			x += n;
 		}
+		oled.flush();
 	}
 
 private:
+	static constexpr uint8_t pages = 2;
+	static constexpr uint8_t chunk = SSD1306_SEGMENT_WIDTH;
+	static_assert(chunk <= 16, "needDraw holds a bit per column");
+
+	struct Scale {
+		uint16_t min;
+		uint16_t range;
+		uint8_t shift;
+		uint8_t zeroVisible;
+		uint16_t factor;
+	};
+
 	SSD1306 & oled;
 	DataArray & arr;
+	Scale scale[3] = {};
+	uint8_t tier = 0;
+	uint8_t drawnTier = 0;
+	uint8_t drawnCursor = 0;
+	uint8_t drawnRevision = 0;
+#if SSD1306_CONTENT_SCROLL
+	// columns the panel still has to scroll, and scrolled ones not drawn
+	uint8_t scrolls = 0;
+	uint8_t shifted = 0;
+	// poll slices until the panel may be written again
+	static constexpr uint8_t scrollSlices = (SSD1306_SCROLL_DELAY_MS + pollSliceMs - 1) / pollSliceMs;
+	uint8_t settle = 0;
+	uint8_t pendingForce = 0;
+#endif
 };
 
 
+enum InputCommand {
+	None = 0,
+	Left,
+	Right,
+	Push,
+};
+
 class IScreen {
 	public:
 		virtual void draw(int8_t force) = 0;
-		virtual void input(uint8_t code) = 0;
+		// Returns zero when the screen does not use the input
+		virtual uint8_t input(uint8_t code) = 0;
 		virtual uint8_t needRedraw() = 0;
 };
 
-class Mhz19Sensor {
-
-public:
-
-	uint16_t getValue() {
-		sendCommand();
-		_delay_ms(5);
-		return readValue();
-	}
-
-	static constexpr int len = 9;
-	uint8_t data[len];
-
-private:
-
-	void sendCommand() {
-		uart_putchar(static_cast<char>(0xFF));
-		uart_putchar(static_cast<char>(0x01));
-		uart_putchar(static_cast<char>(0x86));
-
-		uart_putchar(static_cast<char>(0x00));
-		uart_putchar(static_cast<char>(0x00));
-		uart_putchar(static_cast<char>(0x00));
-		uart_putchar(static_cast<char>(0x00));
-		uart_putchar(static_cast<char>(0x00));
-
-		uart_putchar(static_cast<char>(0x79));
-	}
-
-	uint16_t readValue() {
-		memset(data, 0, len);
-		for(int i = 0; i < len; ++i) {
-			data[i] = uart_getchar();
-		}
-		
-		if(calcCRC(data) == data[8]) {
-			uint16_t h = data[2];
-			uint16_t l = data[3];
-			return h*256 + l;
-		} else {
-			return 0;
-		}
-	}
-	
-	uint8_t calcCRC(uint8_t * data)
-	{
-		uint8_t crc = 0;
-		for (int i = 1; i < len-1; ++i)
-		{
-			crc += data[i];
-		}
-		crc = 0xFF - crc;
-		crc++;
-
-		return crc;
-	}
-};
-
 uint16_t co2Value = 0;
-int8_t temperature = 0;
-uint8_t humidity = 0;
+// tenths of C and %
+int16_t temperature = 0;
+int16_t humidity = 0;
 uint16_t voltage = 380;
 
-Mhz19Sensor co2;
+Mhz19 co2;
 
 class MainScreen
 	: public IScreen
 {
 	public:
 		MainScreen(SSD1306 & oled) 
-			: pSmall(NumberPrinter(oled, 12, 4))
-			, pBig(NumberPrinter(oled, 12, 4))
-			, pLbl(NumberPrinter(oled, 7, 2))
+			: pSmall(NumberPrinter(oled, SSegmentFont<9, 4>::atlas))
+			, pBig(NumberPrinter(oled, SSegmentFont<12, 4>::atlas))
+			, pLbl(NumberPrinter(oled, SSegmentFont<7, 2>::atlas))
 			, str0(NumberStr(pBig, pLbl, 0, 0, 89))
 			, str1(NumberStr(pLbl, pLbl, 90, 0, 32))
-			, str2(NumberStr(pSmall, pLbl, 0, 4, 64))
-			, str3(NumberStr(pSmall, pLbl, 64, 4, 64))
+			, str2(NumberStr(pSmall, pLbl, 0, 4, 64, 1))
+			, str3(NumberStr(pSmall, pLbl, 64, 4, 64, 1))
 		{
 		}
 
 		void draw(int8_t force) override {
 			if(force) {
-				co2Value_ = 0;
-				voltage_ = 0;
-				temperature_ = 0;
-				humidity_ = 0;
+				str0.invalidate();
+				str1.invalidate();
+				str2.invalidate();
+				str3.invalidate();
 			}
-			if(co2Value != co2Value_) {
+			// a forced draw shows every value, zero is a valid reading
+			if(force || co2Value != co2Value_) {
 				co2Value_ = co2Value;
 				str0.setNumber(co2Value, 14);
 			}
-			if(voltage != voltage_) {
+			if(force || voltage != voltage_) {
 				voltage_ = voltage;
 				str1.setNumber(voltage, 13);
 			}
-			if(temperature != temperature_) {
+			if(force || temperature != temperature_) {
 				temperature_ = temperature;
 				str2.setNumber(temperature, 12);
 			}
-			if(humidity != humidity_) {
+			if(force || humidity != humidity_) {
 				humidity_ = humidity;
 				str3.setNumber(humidity, 11);
 			}
@@ -467,10 +1357,14 @@ class MainScreen
 			return redraw;
 		}
 
-		void input(uint8_t code) override 
+		uint8_t input(uint8_t code) override 
 		{
+				if(code == Push) {
+					return 0;
+				}
 				voltage = code;
 				redraw = 1;
+				return 1;
 		}
 
 	private:
@@ -483,8 +1377,8 @@ class MainScreen
 		NumberStr str2;
 		NumberStr str3;
 		uint16_t co2Value_ = 0;
-		int8_t temperature_ = 0;
-		uint8_t humidity_ = 0;
+		int16_t temperature_ = 0;
+		int16_t humidity_ = 0;
 		uint16_t voltage_ = 0;
 		uint8_t redraw = 0;
 };
@@ -495,7 +1389,7 @@ class ChartScreen
 public:
 	ChartScreen(SSD1306 & oled, DataArray & arr) 
 		: arr(arr)
-		,	pSmall(NumberPrinter(oled, 4, 1))
+		,	pSmall(NumberPrinter(oled, SSegmentFont<4, 1>::atlas))
 		, str0(NumberStr(pSmall, pSmall, 0, 0, 36))
 		, str1(NumberStr(pSmall, pSmall, 36, 0, 32))
 		, str2(NumberStr(pSmall, pSmall, 68, 0, 32))
@@ -504,15 +1398,33 @@ public:
 	{
 	}
 	
-	void draw(int8_t) override {
-		str0.setNumber(arr.getLast(0, cursorPosition%128-1)*10, 14);
-		str1.setNumber(arr.getLast(1, cursorPosition%128-1)-50, 12);
-		str2.setNumber(arr.getLast(2, cursorPosition%128-1), 11);
-		str3.setNumber(cursorPosition%128, 13);
-		chart.draw(cursorPosition%128);
+	void draw(int8_t force) override {
+		if(force) {
+			str0.invalidate();
+			str1.invalidate();
+			str2.invalidate();
+			str3.invalidate();
+		}
+		if(chart.settling(force)) {
+			return;
+		}
+		// the input interrupts may move the cursor or zoom while drawing
+		uint8_t cursor = cursorPosition%128;
+		chart.setTier(tier);
+		str0.setNumber(chart.valueAt(0, cursor), 14);
+		if(chart.getTier() == 0) {
+			str1.setNumber(chart.valueAt(1, cursor)-50, 12);
+			str2.setNumber(chart.valueAt(2, cursor), 11);
+		} else {
+			// coarse tiers hold the CO2 mean, minimum and maximum
+			str1.setNumber(chart.valueAt(1, cursor), 15);
+			str2.setNumber(chart.valueAt(2, cursor), 11);
+		}
+		str3.setNumber(cursor, 13);
+		chart.draw(cursor, force);
 	}
 
-	void input(uint8_t code) override 
+	uint8_t input(uint8_t code) override 
 	{
 		switch(code) {
 			case 1: // backward
@@ -523,14 +1435,22 @@ public:
 				cursorPosition++;
 				redraw = 1;
 				break;
-			default:
+			case 3: // zoom out, past the coarsest tier leave the screen
+				if(++tier == DataArray::tiers) {
+					tier = 0;
+					return 0;
+				}
+				redraw = 1;
 				break;
+			default:
+				return 0;
 		}
+		return 1;
 	}
 	
 	uint8_t needRedraw() override
 	{
-		uint8_t res = redraw;
+		uint8_t res = redraw || chart.busy();
 		redraw = 0;
 		return res;
 	}
@@ -544,6 +1464,7 @@ private:
 		NumberStr str3;
 		ChartWidget chart;
 		uint8_t cursorPosition = 127;
+		uint8_t tier = 0;
 		uint8_t redraw = 0;
 };
 
@@ -580,23 +1501,18 @@ private:
 	int pinM;
 };
 
-enum InputCommand {
-	None = 0,
-	Left,
-	Right,
-	Push,
-};
-
-
 OutPin led(&DDRB, &PORTB, 5);
 int cmd = 0;
 
 constexpr int PIN_MHZ_Enable = 7;
 constexpr int PIN_DHT_PullUp = 6;
 constexpr int PIN_DHT_Data = 5;
+// MH-Z19 setup sent with the first reading after boot
+constexpr uint8_t MHZ_Range = MHZ19_RANGE_5000;
+constexpr uint8_t MHZ_Abc = MHZ19_ABC_OFF;
 
 uint8_t screenIndex = 0;
-uint8_t needUpdateScreen = 1;
+volatile uint8_t needUpdateScreen = 1;
 uint8_t debaunce = 0;
 
 uint8_t checkDoInput()
@@ -624,8 +1540,10 @@ ISR(TIMER0_OVF_vect)
 ISR(INT0_vect)
 {
 	if(!(PIND & (1 << PIN2)) && checkDoInput()) {
-		screenIndex++;
-		needUpdateScreen = 1;
+		if(!screens[screenIndex % screenCnt]->input(Push)) {
+			screenIndex++;
+			needUpdateScreen = 1;
+		}
 	}
 }
 
@@ -655,7 +1573,7 @@ public:
 	}
 	T filtered() 
 	{
-		uint32_t tmp = 0;
+		int32_t tmp = 0;
 		for(int i = 0; i < size; ++i)
 		{
 			tmp += buf[i];
@@ -670,8 +1588,34 @@ private:
 
 
 Filter<uint16_t> co2Filter;
-Filter<int8_t> temperatureFilter;
-Filter<uint8_t> humidityFilter;
+Filter<int16_t> temperatureFilter;
+Filter<int16_t> humidityFilter;
+
+// Whole units from tenths, rounded half away from zero
+int16_t roundDeci(int16_t value)
+{
+	return (value + (value < 0 ? -5 : 5)) / 10;
+}
+
+void updateScreen()
+{
+	if(needUpdateScreen || (screens[screenIndex % screenCnt]->needRedraw())) {
+		static uint8_t prevScreenIndex = 0;
+		static int8_t force = 0;
+		needUpdateScreen = 0;
+		led.set();
+		if(prevScreenIndex != screenIndex % screenCnt) {
+			oled.clear();
+			force = 1;
+			prevScreenIndex = screenIndex % screenCnt;
+		}
+		screens[screenIndex % screenCnt]->draw(force);
+		// a frame lost on the bus is drawn in full with the next update
+		oled.flush();
+		force = oled.lost();
+		led.clear();
+	}
+}
 
 int main(void)
 {
@@ -697,11 +1641,16 @@ int main(void)
  
 	led.clear();
 	
-	uart_init(0);
+	uart_init();
+	// history from before the reset, shown on the first frame
+	arr.restore();
 	oled.init();
 	
 	sei();				//Enable Global Interrupt
 
+	co2.send(MHZ_Abc);
+	co2.send(MHZ_Range);
+
 	uint16_t logDelay = 0;
 	uint8_t updateDelay = 0;
 
@@ -710,12 +1659,33 @@ int main(void)
 	oled.clear();
 
 	while(1) {
-		_delay_ms(100);
+		// Poll the sensors and the screen in short slices so encoder input
+		// shows up without waiting for the rest of the loop.
+		for(uint8_t i = 0; i < 10; ++i) {
+			_delay_ms(pollSliceMs);
+			if(co2.poll()) {
+				co2Value = co2.status() == MHZ19_OK ? co2.ppm() : 0;
+				co2Filter.add(co2Value);
+				needUpdateScreen = 1;
+			}
+			if(dht.poll()) {
+				if(dht.status() == DHT_OK) {
+					temperature = dht.temperatureDeci();
+					humidity = dht.humidityDeci();
+				} else {
+					temperature = 0;
+					humidity = 0;
+				}
+				humidityFilter.add(humidity);
+				temperatureFilter.add(temperature);
+				needUpdateScreen = 1;
+			}
+			updateScreen();
+		}
 
 		if(updateDelay++ > 10*6) {
 			updateDelay = 0;
 			needUpdateValues = 1;
-			needUpdateScreen = 1;
 		}
 
 		if(logDelay++ > 10*60*6) { // 6 min
@@ -727,40 +1697,17 @@ int main(void)
 		if(needUpdateValues) {
 			led.set();
 			needUpdateValues = 0;
-			if(dht.readData() != -1) {
-				temperature = dht.gettemperatureC();
-				humidity = dht.gethumidity();
-			} else {
-				temperature = 0;
-				humidity = 0;
-			}
-			co2Value = co2.getValue();
-			
-			co2Filter.add(co2Value/10);
-			humidityFilter.add(humidity);
-			temperatureFilter.add(temperature);
-
-			led.clear();
-		}
-	
-		if(needUpdateScreen || (screens[screenIndex % screenCnt]->needRedraw())) {
-			static uint8_t prevScreenIndex = 0;
-			static int8_t force = 0;
-			needUpdateScreen = 0;
-			led.set();
-			if(prevScreenIndex != screenIndex % screenCnt) {
-				oled.clear();
-				force = 1;
-				prevScreenIndex = screenIndex % screenCnt;
-			}
-			screens[screenIndex % screenCnt]->draw(force);
-			force = 0;
+			// the answers are picked up by the polling above
+			dht.start();
+			co2.request();
 			led.clear();
 		}
 
 		if(needLogData) {
 			needLogData = 0;
-			arr.addValue(co2Filter.filtered(), temperatureFilter.filtered()+50, humidityFilter.filtered());
+			// the history keeps whole units
+			arr.addValue(co2Filter.filtered(), roundDeci(temperatureFilter.filtered())+50, roundDeci(humidityFilter.filtered()));
+			arr.save();
 		}
 	}
 }
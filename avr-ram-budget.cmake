@@ -0,0 +1,32 @@
+##########################################################################
+# Script run by add_avr_executable after linking:
+#
+# cmake -DAVR_SIZE_TOOL=<avr-size> -DELF_FILE=<elf> -DAVR_RAM_BUDGET=<bytes>
+#       -P avr-ram-budget.cmake
+#
+# Adds up the static RAM sections (.data, .bss, .noinit) reported by
+# avr-size and fails when they take more than AVR_RAM_BUDGET bytes. The
+# SRAM left over is what the stack has.
+##########################################################################
+
+execute_process(
+   COMMAND ${AVR_SIZE_TOOL} -A ${ELF_FILE}
+   OUTPUT_VARIABLE sections
+   RESULT_VARIABLE result
+)
+if(result)
+   message(FATAL_ERROR "${AVR_SIZE_TOOL} failed on ${ELF_FILE}")
+endif(result)
+
+set(ram 0)
+string(REGEX MATCHALL "\n\\.(data|bss|noinit)[ \t]+[0-9]+" entries "${sections}")
+foreach(entry ${entries})
+   string(REGEX MATCH "[0-9]+$" size "${entry}")
+   math(EXPR ram "${ram} + ${size}")
+endforeach(entry)
+
+if(ram GREATER AVR_RAM_BUDGET)
+   message(FATAL_ERROR
+      "${ELF_FILE} takes ${ram} bytes of static RAM, the budget is ${AVR_RAM_BUDGET}")
+endif(ram GREATER AVR_RAM_BUDGET)
+message(STATUS "${ELF_FILE}: ${ram} of ${AVR_RAM_BUDGET} bytes static RAM")
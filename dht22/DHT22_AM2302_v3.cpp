@@ -4,135 +4,310 @@ DHT22 & AM2302 Library
 */
 
 #ifndef F_CPU
-#define F_CPU 8000000UL //set fcpu for delay.h if not already set in pref
+#define F_CPU 8000000UL //set fcpu for the timing if not already set in pref
 #endif
 
 #include <stdio.h>
 #include <avr/io.h>
-#include <util/delay.h>
+#include <avr/interrupt.h>
 
 #include "DHT22_AM2302_v3.h"
 
+DHT22Bus * DHT22Bus::active = 0;
+
+// Timer1 ticks at F_CPU/8 for a time in us
+static constexpr uint16_t ticks(uint32_t us)
+{
+	return F_CPU / 8000UL * us / 1000;
+}
+
+static_assert(F_CPU / 8000UL * DHT_TIMEOUT_US / 1000 < 0x10000, "DHT22 transfer does not fit a Timer1 round");
+static_assert(ticks(DHT_ANSWER_US) > ticks(DHT_BIT_US), "DHT22 answer pulse has to be longer than a bit");
+
+// Pin change mask register and enable bit of the port
+static volatile uint8_t * pcmsk(volatile uint8_t * pin)
+{
+	return pin == &PINB ? &PCMSK0 : pin == &PINC ? &PCMSK1 : &PCMSK2;
+}
+
+static uint8_t pcie(volatile uint8_t * pin)
+{
+	return pin == &PINB ? PCIE0 : pin == &PINC ? PCIE1 : PCIE2;
+}
+
+void DHT22Channel::begin()
+{
+	result = DHT_BUSY;
+	bit = -2;
+	for(uint8_t i = 0; i < 5; i++) {
+		bits[i] = 0;
+	}
+}
+
+void DHT22Channel::release(uint16_t now)
+{
+	rise = now;
+	bit = -1;
+}
+
+// a falling edge ends a high pulse, its width tells the bit
+void DHT22Channel::edge(uint8_t high, uint16_t now)
+{
+	if(result != DHT_BUSY || bit == -2) {
+		return;
+	}
+	if(high) {
+		rise = now;
+		return;
+	}
+
+	uint16_t width = now - rise;
+	if(bit < 0) {
+		// skips the line rising after the release until the answer pulse
+		if(width >= ticks(DHT_ANSWER_US)) {
+			bit = 0;
+		}
+		return;
+	}
+	if(width >= ticks(DHT_BIT_US)) {
+		bits[bit >> 3] |= 0x80 >> (bit & 7);
+	}
+	if(++bit == 40) {
+		//check checksum
+		if((uint8_t)(bits[0] + bits[1] + bits[2] + bits[3]) == bits[4]) {
+			rawHumidity = bits[0]<<8 | bits[1];
+			rawTemperature = bits[2]<<8 | bits[3];
+			result = DHT_OK;
+		} else {
+			result = DHT_ERR_CHECKSUM;
+		}
+	}
+}
+
+void DHT22Channel::timeout()
+{
+	if(result == DHT_BUSY) {
+		result = DHT_ERR_TIMEOUT;
+	}
+}
+
+int8_t DHT22Channel::status() const
+{
+	return result;
+}
+
+//get temperature in Celsius, the sensor sends sign and magnitude
+int16_t DHT22Channel::temperatureDeci() const
+{
+	if(rawTemperature & 0x8000)
+	{
+		return -(int16_t)(rawTemperature & 0x7FFF);
+	}
+	return rawTemperature;
+}
+
+//get Humidity
+int16_t DHT22Channel::humidityDeci() const
+{
+	return rawHumidity;
+}
+
+//get temperature in Fahrenheit, rounded to the nearest tenth
+int16_t DHT22Channel::temperatureFDeci() const
+{
+	int16_t t = temperatureDeci() * 9;
+	return (t + (t < 0 ? -2 : 2)) / 5 + 320; //Return temp in F
+}
+
+//Initialize the bus with (&DDRX, &PORTX, &PINX, mask, channels)
+DHT22Bus::DHT22Bus(volatile uint8_t *ddr, volatile uint8_t *port, volatile uint8_t *pin, uint8_t pins, DHT22Channel *channels)
+	: ddr(ddr), port(port), pin(pin), pins(pins), channel_(channels)
+{
+	for(uint8_t m = 1; m; m <<= 1) {
+		if(pins & m) {
+			count++;
+		}
+	}
+}
+
+// start all sensors, the bits are collected from the interrupts
+void DHT22Bus::start()
+{
+	uint8_t sreg = SREG;
+	cli();
+	if(active) {
+		active->finish();
+	}
+	active = this;
+	done = 0;
+	released = 0;
+	for(uint8_t i = 0; i < count; i++) {
+		channel_[i].begin();
+	}
+	//Timer1 free running at F_CPU/8
+	TCCR1A = 0;
+	TCCR1B = _BV(CS11);
+
+	//send request on every pin, the lines are released from the timer
+	*port &= ~pins; //low
+	*ddr |= pins; //output
+	OCR1A = TCNT1 + ticks(DHT_START_US);
+	TIFR1 = _BV(OCF1A);
+	TIMSK1 |= _BV(OCIE1A);
+	SREG = sreg;
+}
+
+uint8_t DHT22Bus::poll()
+{
+	if(!done) {
+		return 0;
+	}
+	done = 0;
+	return 1;
+}
+
+uint8_t DHT22Bus::channels()
+{
+	return count;
+}
+
+const DHT22Channel & DHT22Bus::channel(uint8_t i)
+{
+	return channel_[i];
+}
+
+// end of the start pulses, then the timeout of the transfer
+void DHT22Bus::handleTimer()
+{
+	DHT22Bus * b = active;
+	if(!b) {
+		TIMSK1 &= ~_BV(OCIE1A);
+		return;
+	}
+	if(b->released) {
+		b->finish();
+		return;
+	}
+
+	*b->port |= b->pins; //high
+	*b->ddr &= ~b->pins; //input
+	uint16_t now = TCNT1;
+	b->last = *b->pin;
+	for(uint8_t i = 0; i < b->count; i++) {
+		b->channel_[i].release(now);
+	}
+	b->released = 1;
+	OCR1A = now + ticks(DHT_TIMEOUT_US);
+
+	// start watching the pins, edges from before are dropped
+	*pcmsk(b->pin) |= b->pins;
+	PCIFR = _BV(pcie(b->pin));
+	PCICR |= _BV(pcie(b->pin));
+}
+
+// one sample of the whole port serves every channel which changed since the last one
+void DHT22Bus::handleEdge()
+{
+	uint16_t now = TCNT1;
+	DHT22Bus * b = active;
+	if(!b || !b->released) {
+		return;
+	}
+	uint8_t in = *b->pin;
+	uint8_t changed = (in ^ b->last) & b->pins;
+	b->last = in;
+
+	uint8_t busy = 0;
+	DHT22Channel * c = b->channel_;
+	for(uint8_t m = 1; m; m <<= 1) {
+		if(b->pins & m) {
+			if(changed & m) {
+				c->edge(in & m, now);
+			}
+			busy |= c->status() == DHT_BUSY;
+			c++;
+		}
+	}
+	if(!busy) {
+		b->finish();
+	}
+}
+
+// channels still running have timed out
+void DHT22Bus::finish()
+{
+	TIMSK1 &= ~_BV(OCIE1A);
+	*pcmsk(pin) &= ~pins;
+	for(uint8_t i = 0; i < count; i++) {
+		channel_[i].timeout();
+	}
+	done = 1;
+	active = 0;
+}
+
 //Default Constructor - uses defaults set in header for port and pin
 DHT22::DHT22()
+	: DHT22Bus(&DDRD, &PORTD, &PIND, 1, &sensor)
 {
-	temperature = humidity = 0;		//initialize temperature and humidity values to 0
 }
 
 //This constructor accepts a pin value and uses the defaults in the header for the port
 DHT22::DHT22(int dataPin)
+	: DHT22Bus(&DDRD, &PORTD, &PIND, 1<<dataPin, &sensor)
 {
-	dht22_inputPin = dataPin;		// Assign data input pin for specified port
-	temperature = humidity = 0;		//initialize temperature and humidity values to 0
 }
 
 //Initialize the object with (&DDRX, &PORTX, &PINX, X) accepts port and pin definitions
 DHT22::DHT22(volatile uint8_t *ddr, volatile uint8_t *port, volatile uint8_t *pin, int dataPin)
+	: DHT22Bus(ddr, port, pin, 1<<dataPin, &sensor)
+{
+}
+
+int8_t DHT22::status()
 {
-	dht22_ddr = ddr;				// Copy pointer of DDRX address to class private pointer for later use
-	dht22_pin = pin;				// Pointer to Pointer copy, address pointed to by pointer1(ddr) is copied to pointer2(dht22_ddr)
-	dht22_port = port;				// which is why no * required
-	dht22_inputPin = dataPin;		// Assign data input pin for specified port
-	temperature = humidity = 0;		//initialize temperature and humidity values to 0
+	return sensor.status();
 }
 
 // get data from sensor
 int8_t DHT22::readData()
 {
-	//*** uint8_t bits[5];
-	uint8_t bits[5] = {};
-	uint8_t i,j = 0;
-
-	//reset port
-	*dht22_ddr |= (1<<dht22_inputPin); //output
-	*dht22_port |= (1<<dht22_inputPin); //high
-	_delay_ms(100);
-
-	//send request
-	*dht22_port &= ~(1<<dht22_inputPin); //low
-	_delay_us(500);
-	*dht22_port |= (1<<dht22_inputPin); //high
-	*dht22_ddr &= ~(1<<dht22_inputPin); //input
-	_delay_us(40);
-
-	//check start condition 1
-	if((*dht22_pin & (1<<dht22_inputPin))) {
-		return -1;
-	}
-	_delay_us(80);
-	
-	//check start condition 2
-	if(!(*dht22_pin & (1<<dht22_inputPin))) {
-		return -1;
-	}
-	_delay_us(80);
-
-	//read the data
-	uint16_t timeoutcounter = 0;
-	for (j=0; j<5; j++) { //read 5 byte
-		uint8_t result=0;
-		for(i=0; i<8; i++) {//read every bit
-			timeoutcounter = 0;
-			while(!(*dht22_pin & (1<<dht22_inputPin))) { //wait for an high input (non blocking)
-				timeoutcounter++;
-				if(timeoutcounter > DHT_TIMEOUT) {
-					return -1; //timeout
-				}
-			}
-			_delay_us(30);
-			if(*dht22_pin & (1<<dht22_inputPin)) //if input is high after 30 us, get result
-			result |= (1<<(7-i));
-			timeoutcounter = 0;
-			while(*dht22_pin & (1<<dht22_inputPin)) { //wait until input get low (non blocking)
-				timeoutcounter++;
-				if(timeoutcounter > DHT_TIMEOUT) {
-					return -1; //timeout
-				}
-			}
-		}
-		bits[j] = result;
-	}
+	start();
+	while(!poll());
+	return sensor.status() == DHT_OK ? 0 : -1;
+}
 
-	//reset port
-	*dht22_ddr |= (1<<dht22_inputPin); //output
-	*dht22_port |= (1<<dht22_inputPin); //low
-	_delay_ms(100);
+int16_t DHT22::temperatureDeci()
+{
+	return sensor.temperatureDeci();
+}
 
-	//check checksum
-	if ((uint8_t)(bits[0] + bits[1] + bits[2] + bits[3]) == bits[4])
-	{
-		//return temperature and humidity
-		uint16_t rawhumidity = bits[0]<<8 | bits[1];
-		uint16_t rawtemperature = bits[2]<<8 | bits[3];
-		if(rawtemperature & 0x8000)
-		{
-			temperature = (float)((rawtemperature & 0x7FFF) / 10.0) * -1.0;
-		}
-		else
-		{
-			temperature = (float)(rawtemperature)/10.0;
-		}
-		humidity = (float)(rawhumidity)/10.0;
-		return 0;
-	}
+int16_t DHT22::humidityDeci()
+{
+	return sensor.humidityDeci();
+}
 
-	return -1;
+int16_t DHT22::temperatureFDeci()
+{
+	return sensor.temperatureFDeci();
 }
 
-//get temperature in Celsius
-float DHT22::gettemperatureC()
+ISR(TIMER1_COMPA_vect)
 {
-	return temperature;
+	DHT22Bus::handleTimer();
 }
 
-//get Humidity
-float DHT22::gethumidity()
+// any port may carry the data pins
+ISR(PCINT0_vect)
+{
+	DHT22Bus::handleEdge();
+}
+
+ISR(PCINT1_vect)
 {
-	return humidity;
+	DHT22Bus::handleEdge();
 }
 
-//get temperature in Fahrenheit 
-float DHT22::gettemperatureF()
+ISR(PCINT2_vect)
 {
-	return (temperature * 1.8) + 32; //Return temp in F
+	DHT22Bus::handleEdge();
 }
@@ -1,10 +1,11 @@
 // 
-// Library for communicating with DHT22 and AM2302 temperature and humidity sensors using pin polling.
+// Library for communicating with DHT22 and AM2302 temperature and humidity sensors using pin change interrupts.
 // Author : Leonid (DLM)
 //
-// Update your PORT and pin configuration for your device in the beginning of this header.
-// Create DHT22 object in program, call readData function, then you can access the updated values using provided functions.
-// readData needs to be called every time you want to update the temp and humidity values, it will return -1 if error occurs.
+// Create DHT22 object in program, call start, then poll until it reports the measurement finished.
+// The bits are timed in the background from the pin change interrupt of the data pin and the free running Timer1.
+// Update the values every time you want them with start; readData does start and waits for the result, it will return -1 if error occurs.
+// DHT22Bus reads sensors on several pins of one port in a single transfer, DHT22 is a bus of one pin.
 //
 
 
@@ -12,27 +13,81 @@
 #ifndef DHT22_AM2302_V3_H
 #define DHT22_AM2302_V3_H
 
-//timeout retries
-#define DHT_TIMEOUT 200			// Used to timeout of trying to read sensor if error occurs.
+#include <stdint.h>
 
-class DHT22 //Class for DHT22 sensor to read and return data.
+#define DHT_START_US 1000		// Start pulse, the datasheet asks for at least 1 ms
+#define DHT_TIMEOUT_US 6000		// Whole transfer, the answer takes at most about 5 ms
+#define DHT_BIT_US 48			// High pulses are 26-28 us for a 0 and 70 us for a 1
+#define DHT_ANSWER_US 60		// The answer pulse before the bits is 80 us high
+
+// Measurement results
+#define DHT_OK 0
+#define DHT_BUSY 1				// started, bits still coming in
+#define DHT_ERR_TIMEOUT -1		// no answer, or edges were missed
+#define DHT_ERR_CHECKSUM -2
+
+class DHT22Channel //Decodes one sensor from the edges of its data line, timed by Timer1.
+{
+public:
+	void begin();				// start pulse is out, edges are ignored until release
+	void release(uint16_t now);	// the line was released at Timer1 time now
+	void edge(uint8_t high, uint16_t now);	// the line changed to high or low
+	void timeout();				// gives up a transfer which is still running
+	int8_t status() const;		// DHT_OK, DHT_BUSY or an error
+	int16_t temperatureDeci() const;	// returns temperature in tenths of a degree Celsius
+	int16_t temperatureFDeci() const;	// returns temperature in tenths of a degree Fahrenheit
+	int16_t humidityDeci() const;		// returns Humidity in tenths of a percent
+private:
+	uint16_t rawTemperature = 0;	// last good reading, tenths of C with the sign in bit 15
+	uint16_t rawHumidity = 0;	// last good reading, tenths of %
+	volatile int8_t result = DHT_OK;
+	uint8_t bits[5];			// received bytes
+	int8_t bit = -2;			// next bit, -1 until the answer pulse was seen, -2 before the release
+	uint16_t rise;				// Timer1 at the last rising edge
+};
+
+class DHT22Bus //Reads the sensors on several pins of one port together.
+{
+public:
+	// pins is the mask of the data pins, one sensor each; channels count from the lowest pin and
+	// have to hold one DHT22Channel per pin
+	// example: DHT22Channel rooms[4]; DHT22Bus bus(&DDRB, &PORTB, &PINB, 0x0F, rooms) <-Sets Port B pins 0 to 3 as channels 0 to 3
+	DHT22Bus(volatile uint8_t *ddr, volatile uint8_t *port, volatile uint8_t *pin, uint8_t pins, DHT22Channel *channels);
+	void start();				// all start pulses go out at once, Timer1 runs free at F_CPU/8 from then on
+	uint8_t poll();				// returns 1 once when every channel has finished, their status tells how
+	uint8_t channels();			// number of sensors
+	const DHT22Channel & channel(uint8_t i);	// result and values of one sensor
+
+	static void handleEdge();	// called from the pin change interrupts
+	static void handleTimer();	// called from the Timer1 compare A interrupt
+private:
+	void finish();
+
+	volatile uint8_t *ddr;		// Data Direction Register (DDRX)
+	volatile uint8_t *port;		// Pin Output Register (PORTX)
+	volatile uint8_t *pin;		// Pin Input Register (PINX)
+	uint8_t pins;
+	uint8_t count = 0;
+	DHT22Channel *channel_;
+	uint8_t last;				// port pins at the last edge, other pins of the port interrupt too
+	volatile uint8_t done = 0;
+	uint8_t released = 0;		// the start pulses have ended
+	static DHT22Bus * active;	// transfer in progress, one at a time
+};
+
+class DHT22 : public DHT22Bus //Class for DHT22 sensor to read and return data.
 {
 public:
 	DHT22();					// Constructor initializes private variables and pin to 0.
 	DHT22(int);					// Constructor to select inputPin for the DHT22, defaults to PORTD.
 	DHT22(volatile uint8_t *, volatile uint8_t *, volatile uint8_t *, int dataPin);		// example: DHT22 dht22(&DDRB, &PORTB, &PINB, 6) <-Sets Port B pin 6 as data pin
-	int8_t readData();			// acquire data from sensor, this function updates the Temp and Humidity values.
-	float gettemperatureC();	// returns float temperature in Celsius
-	float gettemperatureF();	// returns float temperature in Fahrenheit
-	float gethumidity();		// returns float Humidity
+	int8_t status();			// DHT_OK, DHT_BUSY or an error
+	int8_t readData();			// start and wait for the result, this function updates the Temp and Humidity values.
+	int16_t temperatureDeci();	// returns temperature in tenths of a degree Celsius
+	int16_t temperatureFDeci();	// returns temperature in tenths of a degree Fahrenheit
+	int16_t humidityDeci();		// returns Humidity in tenths of a percent
 private:
-	float temperature;			// Float variable to store Temperature in Celsius
-	float humidity;				// Float variable to store Relative Humidity 
-	volatile uint8_t *dht22_ddr = &DDRD;		// Data Direction Register (DDRX) 
-	volatile uint8_t *dht22_port = &PORTD;		// Pin Output Register (PORTX)	
-	volatile uint8_t *dht22_pin = &PIND;		// Pin Input Register (PINX)
-	uint8_t dht22_inputPin;		// integer to store the Input Pin being used for the sensor (can define default pin here if c++11 support)
-
+	DHT22Channel sensor;
 };
 
 #endif
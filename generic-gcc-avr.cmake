@@ -26,6 +26,9 @@
 #     the port used for the upload tool, e.g. usb
 # AVR_PROGRAMMER (default: avrispmkII)
 #     the programmer hardware used, e.g. avrispmkII
+# AVR_RAM_BUDGET (NO DEFAULT)
+#     bytes of static RAM (.data, .bss, .noinit) an executable may take,
+#     checked with avr-size after linking
 ##########################################################################
 
 ##########################################################################
@@ -42,6 +45,9 @@ find_program(AVR_OBJCOPY avr-objcopy)
 find_program(AVR_SIZE_TOOL avr-size)
 find_program(AVR_OBJDUMP avr-objdump)
 
+# run after linking when AVR_RAM_BUDGET is set
+set(AVR_RAM_BUDGET_SCRIPT ${CMAKE_CURRENT_LIST_DIR}/avr-ram-budget.cmake)
+
 ##########################################################################
 # toolchain starts with defining mandatory variables
 ##########################################################################
@@ -167,8 +173,19 @@ function(add_avr_executable EXECUTABLE_NAME)
 				 LINK_FLAGS "-Os -mmcu=${AVR_MCU}"
    )
 
+   # static RAM check, no hex file is made when it fails
+   if(AVR_RAM_BUDGET)
+      set(ram_check
+         COMMAND
+            ${CMAKE_COMMAND} -DAVR_SIZE_TOOL=${AVR_SIZE_TOOL}
+               -DELF_FILE=${elf_file} -DAVR_RAM_BUDGET=${AVR_RAM_BUDGET}
+               -P ${AVR_RAM_BUDGET_SCRIPT}
+      )
+   endif(AVR_RAM_BUDGET)
+
    add_custom_command(
       OUTPUT ${hex_file}
+      ${ram_check}
       COMMAND
          ${AVR_OBJCOPY} -j .text -j .data -O ihex ${elf_file} ${hex_file}
       COMMAND
@@ -0,0 +1,71 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "Eeprom.h"
+
+const EepromRegion * Eeprom::regions = 0;
+uint8_t Eeprom::count = 0;
+uint8_t Eeprom::region = 0;
+uint16_t Eeprom::offset = 0;
+
+void Eeprom::sync(const EepromRegion * table, uint8_t n)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        regions = table;
+        count = n;
+        region = 0;
+        offset = 0;
+        EECR |= _BV(EERIE);
+    }
+}
+
+uint8_t Eeprom::busy()
+{
+    return EECR & _BV(EERIE);
+}
+
+uint8_t Eeprom::read(uint16_t address)
+{
+    for (;;) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            if (!(EECR & _BV(EEPE))) {
+                EEAR = address;
+                EECR |= _BV(EERE);
+                return EEDR;
+            }
+        }
+    }
+}
+
+void Eeprom::handleInterrupt()
+{
+    for (uint8_t n = EEPROM_COMPARE_CHUNK; n; --n) {
+        if (region == count) {
+            EECR &= ~_BV(EERIE);
+            return;
+        }
+        const EepromRegion & r = regions[region];
+        uint16_t address = r.address + offset;
+        uint8_t value = r.data ? static_cast<const uint8_t *>(r.data)[offset] : 0;
+        if (++offset == r.size) {
+            ++region;
+            offset = 0;
+        }
+
+        // EE_READY means no write is running, so the cell can be read
+        EEAR = address;
+        EECR |= _BV(EERE);
+        if (EEDR != value) {
+            // erase and write; EEPE has to follow EEMPE within 4 cycles
+            EEDR = value;
+            EECR |= _BV(EEMPE);
+            EECR |= _BV(EEPE);
+            return;
+        }
+    }
+}
+
+ISR(EE_READY_vect) {
+    Eeprom::handleInterrupt();
+}
@@ -0,0 +1,47 @@
+#ifndef _EEPROM_H_
+#define _EEPROM_H_
+
+#include <stdint.h>
+
+// Bytes compared per EE_READY interrupt while nothing needs writing. The
+// interrupt stays pending while the EEPROM is idle, so the next chunk runs
+// as soon as other interrupts have been served. The handler runs with
+// interrupts off for about 3 us per byte; 4 keeps it well inside the
+// 20 us margin of the DHT22 pulse timing.
+#ifndef EEPROM_COMPARE_CHUNK
+#define EEPROM_COMPARE_CHUNK 4
+#endif
+
+// A block of RAM mirrored at an EEPROM address, without data the bytes
+// are cleared to zero
+struct EepromRegion {
+    uint16_t address;
+    const void * data;
+    uint16_t size;
+};
+
+// Interrupt driven EEPROM writer. A pass walks the regions in order and
+// programs the bytes which differ from RAM, one per EE_READY interrupt, so
+// the caller never waits for the 3.4 ms cell write and unchanged cells are
+// not worn.
+class Eeprom {
+public:
+    // Starts a pass over count regions, a pass in progress starts over.
+    // The table and the RAM it points to have to stay valid while busy();
+    // RAM changed during a pass needs another sync().
+    static void sync(const EepromRegion * regions, uint8_t count);
+    static uint8_t busy();
+    // Reads a byte, waiting for a cell write of the pass to finish. Reads
+    // with avr-libc could race the interrupt moving EEAR.
+    static uint8_t read(uint16_t address);
+
+    static void handleInterrupt();
+
+private:
+    static const EepromRegion * regions;
+    static uint8_t count;
+    static uint8_t region;
+    static uint16_t offset;
+};
+
+#endif
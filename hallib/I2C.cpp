@@ -25,51 +25,357 @@ OTHER DEALINGS IN THE SOFTWARE.
 For more information, please refer to <http://unlicense.org/>
 */
 
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+
 #include "I2C.h"
 
-void I2C::init(uint8_t address) {
+I2C::Transaction I2C::queue[I2C_QUEUE_SIZE];
+volatile uint8_t I2C::queueHead = 0;
+volatile uint8_t I2C::queueTail = 0;
+volatile uint8_t I2C::running = 0;
+volatile uint8_t I2C::progress = 0;
+volatile uint8_t I2C::lastStatus = I2C_OK;
+volatile uint8_t I2C::fault = I2C_OK;
+uint16_t I2C::position = 0;
+
+static uint8_t error(uint8_t twStatus) {
+    switch (twStatus) {
+    case TW_MT_ARB_LOST:
+        return I2C_ERR_ARBITRATION;
+    case TW_BUS_ERROR:
+        return I2C_ERR_BUS;
+    default:
+        return I2C_ERR_NACK;
+    }
+}
+
+void I2C::init(uint8_t address, uint8_t twbr, uint8_t twps) {
     this->address = address;
-    TWSR = 0;
-    TWBR = ((F_CPU/SCL_CLOCK)-16)/2;
+    this->twbr = twbr;
+    this->twps = twps;
+    setClock(twbr, twps);
+}
+
+void I2C::setClock(uint8_t twbr, uint8_t twps) {
+    TWSR = twps;
+    TWBR = twbr;
 }
 
 uint8_t I2C::start() {
+    // The blocking calls must not cut into a queued transfer; its errors
+    // are left for flush()
+    wait(0);
+    setClock(twbr, twps);
+
     TWCR = (1<<TWINT) | (1<<TWSTA) | (1<<TWEN);
-    while(!(TWCR & (1<<TWINT)));
+    if (waitInterrupt()) {
+        return I2C_ERR_TIMEOUT;
+    }
 
     twi_status_register = TW_STATUS & 0xF8;
     if ((this->twi_status_register != TW_START) && (this->twi_status_register != TW_REP_START)) {
-        return 1;
+        return error(twi_status_register);
     }
 
     TWDR = address;
     TWCR = (1<<TWINT) | (1<<TWEN);
 
-    while(!(TWCR & (1<<TWINT)));
+    if (waitInterrupt()) {
+        return I2C_ERR_TIMEOUT;
+    }
 
     this->twi_status_register = TW_STATUS & 0xF8;
     if ((this->twi_status_register != TW_MT_SLA_ACK) && (this->twi_status_register != TW_MR_SLA_ACK)) {
-        return 1;
+        return error(twi_status_register);
     }
 
-    return 0;
+    return I2C_OK;
 }
 
 uint8_t I2C::write(uint8_t data) {
     TWDR = data;
     TWCR = (1<<TWINT) | (1<<TWEN);
 
-    while(!(TWCR & (1<<TWINT)));
+    if (waitInterrupt()) {
+        return I2C_ERR_TIMEOUT;
+    }
 
     this->twi_status_register = TW_STATUS & 0xF8;
     if (this->twi_status_register != TW_MT_DATA_ACK) {
-        return 1;
+        return error(twi_status_register);
     } else {
-        return 0;
+        return I2C_OK;
     }
 }
 
+uint8_t I2C::write(const uint8_t * data, uint16_t len) {
+    while (len--) {
+        uint8_t res = write(*data++);
+        if (res) {
+            return res;
+        }
+    }
+    return I2C_OK;
+}
+
+uint8_t I2C::fill(uint8_t value, uint16_t len) {
+    while (len--) {
+        uint8_t res = write(value);
+        if (res) {
+            return res;
+        }
+    }
+    return I2C_OK;
+}
+
 void I2C::stop(void) {
     TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWSTO);
-    while(TWCR & (1<<TWSTO));
+    for (uint16_t idle = 0; TWCR & (1<<TWSTO); ++idle) {
+        if (idle > I2C_TIMEOUT_LOOPS) {
+            recover();
+            return;
+        }
+        _delay_us(1);
+    }
+}
+
+uint8_t I2C::waitInterrupt() {
+    for (uint16_t idle = 0; !(TWCR & (1<<TWINT)); ++idle) {
+        if (idle > I2C_TIMEOUT_LOOPS) {
+            recover();
+            return I2C_ERR_TIMEOUT;
+        }
+        _delay_us(1);
+    }
+    return I2C_OK;
+}
+
+uint8_t I2C::submit(uint8_t control, const uint8_t * data, uint16_t len,
+                    uint8_t flags, void (*done)(uint8_t status)) {
+    if ((flags & I2C_INLINE) && len > I2C_INLINE_SIZE) {
+        return I2C_ERR_SIZE;
+    }
+    if (wait(1)) {
+        return I2C_ERR_TIMEOUT;
+    }
+
+    Transaction & t = queue[queueHead];
+    t.address = address;
+    t.twbr = twbr;
+    t.twps = twps;
+    t.control = control;
+    t.flags = flags;
+    t.len = len;
+    t.done = done;
+    if (flags & I2C_FILL) {
+        t.bytes[0] = *data;
+    } else if (flags & I2C_INLINE) {
+        for (uint8_t i = 0; i < len; ++i) {
+            t.bytes[i] = data[i];
+        }
+    } else {
+        t.data = data;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        queueHead = (queueHead + 1) % I2C_QUEUE_SIZE;
+    }
+    return startQueue();
+}
+
+// Starts the engine on the oldest queued transaction unless it is running.
+// The STOP of the previous transfer may still be on the bus; it is polled
+// with interrupts enabled, so pin change edges are not held off meanwhile.
+uint8_t I2C::startQueue() {
+    for (uint16_t idle = 0;; ++idle) {
+        uint8_t started = 0;
+
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            if (running || queueTail == queueHead) {
+                started = 1;
+            } else if (!(TWCR & (1<<TWSTO))) {
+                running = 1;
+                setClock(queue[queueTail].twbr, queue[queueTail].twps);
+                TWCR = (1<<TWINT) | (1<<TWSTA) | (1<<TWEN) | (1<<TWIE);
+                started = 1;
+            }
+        }
+        if (started) {
+            return I2C_OK;
+        }
+        if (idle > I2C_TIMEOUT_LOOPS) {
+            recover();
+            return I2C_ERR_TIMEOUT;
+        }
+        _delay_us(1);
+    }
+}
+
+uint8_t I2C::busy() {
+    return running || (TWCR & (1<<TWSTO));
+}
+
+uint8_t I2C::flush() {
+    uint8_t result = wait(0);
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (!result) {
+            result = fault;
+        }
+        fault = I2C_OK;
+    }
+    return result;
+}
+
+uint8_t I2C::status() {
+    return lastStatus;
+}
+
+// Waits for a free queue slot or for the whole queue to drain. The engine
+// is stepped by hand while global interrupts are off, e.g. when the display
+// is initialised before sei(). If the engine makes no progress for
+// I2C_TIMEOUT_LOOPS polls the bus is recovered and the queue dropped.
+uint8_t I2C::wait(uint8_t freeSlot) {
+    uint8_t seen = progress;
+    uint16_t idle = 0;
+
+    for (;;) {
+        if (freeSlot ? (queueHead + 1) % I2C_QUEUE_SIZE != queueTail
+                     : !running && !(TWCR & (1<<TWSTO))) {
+            return I2C_OK;
+        }
+        if (!(SREG & (1<<SREG_I)) && (TWCR & (1<<TWINT))) {
+            handleInterrupt();
+        }
+        if (seen != progress) {
+            seen = progress;
+            idle = 0;
+        } else if (++idle > I2C_TIMEOUT_LOOPS) {
+            recover();
+            return I2C_ERR_TIMEOUT;
+        }
+        _delay_us(1);
+    }
+}
+
+// Frees a slave which holds SDA low in the middle of a byte: nine clock
+// pulses, a STOP condition, then the TWI is enabled again. Queued
+// transactions are dropped and completed with I2C_ERR_TIMEOUT.
+void I2C::recover() {
+    TWCR = 0;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        while (queueTail != queueHead) {
+            void (*done)(uint8_t) = queue[queueTail].done;
+            queueTail = (queueTail + 1) % I2C_QUEUE_SIZE;
+            if (done) {
+                done(I2C_ERR_TIMEOUT);
+            }
+        }
+        running = 0;
+        lastStatus = I2C_ERR_TIMEOUT;
+        if (!fault) {
+            fault = I2C_ERR_TIMEOUT;
+        }
+    }
+
+    // Open drain by hand: a line is pulled low as output, released as input
+    I2C_PORT &= ~((1<<I2C_SCL) | (1<<I2C_SDA));
+    I2C_DDR &= ~((1<<I2C_SCL) | (1<<I2C_SDA));
+
+    for (uint8_t i = 0; i < 9; ++i) {
+        _delay_us(5);
+        I2C_DDR |= (1<<I2C_SCL);
+        _delay_us(5);
+        I2C_DDR &= ~(1<<I2C_SCL);
+    }
+
+    // STOP: SDA rises while SCL is high
+    I2C_DDR |= (1<<I2C_SCL);
+    _delay_us(5);
+    I2C_DDR |= (1<<I2C_SDA);
+    _delay_us(5);
+    I2C_DDR &= ~(1<<I2C_SCL);
+    _delay_us(5);
+    I2C_DDR &= ~(1<<I2C_SDA);
+    _delay_us(5);
+
+    TWCR = (1<<TWEN);
+}
+
+uint8_t I2C::Transaction::byteAt(uint16_t index) const {
+    if (flags & I2C_FILL) {
+        return bytes[0];
+    }
+    if (flags & I2C_INLINE) {
+        return bytes[index];
+    }
+    if (flags & I2C_PROGMEM) {
+        return pgm_read_byte(data + index);
+    }
+    return data[index];
+}
+
+void I2C::handleInterrupt() {
+    const Transaction & t = queue[queueTail];
+    uint8_t twStatus = TW_STATUS & 0xF8;
+
+    ++progress;
+    switch (twStatus) {
+    case TW_START:
+    case TW_REP_START:
+        // SCL is held low here, so the bus can switch to this device's clock
+        setClock(t.twbr, t.twps);
+        TWDR = t.address;
+        position = 0;
+        TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWIE);
+        break;
+    case TW_MT_SLA_ACK:
+    case TW_MT_DATA_ACK:
+        if (position > t.len) {
+            finish(I2C_OK);
+            break;
+        }
+        TWDR = position ? t.byteAt(position - 1) : t.control;
+        ++position;
+        TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWIE);
+        break;
+    default:
+        finish(error(twStatus));
+        break;
+    }
+}
+
+void I2C::finish(uint8_t status) {
+    const Transaction & t = queue[queueTail];
+    void (*done)(uint8_t) = t.done;
+
+    lastStatus = status;
+    if (!fault) {
+        fault = status;
+    }
+    queueTail = (queueTail + 1) % I2C_QUEUE_SIZE;
+    if (queueTail != queueHead) {
+        // STOP and START in between two devices use the slower clock
+        const Transaction & next = queue[queueTail];
+        if (next.twps > t.twps || (next.twps == t.twps && next.twbr > t.twbr)) {
+            setClock(next.twbr, next.twps);
+        }
+        // STOP immediately followed by the START of the next transaction
+        TWCR = (1<<TWINT) | (1<<TWSTA) | (1<<TWSTO) | (1<<TWEN) | (1<<TWIE);
+    } else {
+        running = 0;
+        TWCR = (1<<TWINT) | (1<<TWSTO) | (1<<TWEN);
+    }
+
+    if (done) {
+        done(status);
+    }
+}
+
+ISR(TWI_vect) {
+    I2C::handleInterrupt();
 }
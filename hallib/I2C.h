@@ -31,16 +31,132 @@ For more information, please refer to <http://unlicense.org/>
 #include <stdint.h>
 #include <util/twi.h>
 
-#define SCL_CLOCK  100000L
+// Default bus clock, set from CMake. A device may ask for its own clock
+// with init<clock>(); the bus is switched per transaction.
+#ifndef I2C_SCL_CLOCK
+#define I2C_SCL_CLOCK 400000UL
+#endif
+
+// Bit rate register and prescaler for SCL = F_CPU / (16 + 2 * TWBR * 4^TWPS).
+// Both are rounded up, so the bus never runs faster than scl.
+template <uint32_t scl>
+struct I2CClock {
+    static_assert(scl > 0 && F_CPU / scl >= 16, "I2C clock is faster than F_CPU/16");
+
+    static constexpr uint32_t period = (F_CPU + scl - 1) / scl;
+    static constexpr uint32_t divider = period >= 16 ? (period - 16 + 1) / 2 : 0;
+    static constexpr uint8_t twps = divider <= 0xFFUL ? 0
+                                  : divider <= 0xFFUL * 4 ? 1
+                                  : divider <= 0xFFUL * 16 ? 2 : 3;
+    static constexpr uint32_t scale = 1UL << (2 * twps);
+    static constexpr uint8_t twbr = (divider + scale - 1) / scale;
+
+    static_assert((divider + scale - 1) / scale <= 0xFF, "I2C clock is too slow for F_CPU");
+};
+
+// Transfer results
+#define I2C_OK              0
+#define I2C_ERR_NACK        1   // address or data byte not acknowledged
+#define I2C_ERR_TIMEOUT     2   // no bus progress within I2C_TIMEOUT_LOOPS polls
+#define I2C_ERR_ARBITRATION 3   // another master took the bus
+#define I2C_ERR_BUS         4   // illegal START/STOP seen on the bus
+#define I2C_ERR_SIZE        5   // I2C_INLINE payload longer than I2C_INLINE_SIZE
+
+// Polls of a wait for the bus before it is recovered. A poll takes 1 us
+// of delay plus the loop itself, so the default gives up after 1-2 ms.
+#ifndef I2C_TIMEOUT_LOOPS
+#define I2C_TIMEOUT_LOOPS 1000
+#endif
+
+// TWI pins, driven by hand to clock a stuck slave free
+#define I2C_PORT PORTC
+#define I2C_DDR  DDRC
+#define I2C_SDA  PC4
+#define I2C_SCL  PC5
+
+// Queue entries of the background engine. One stays free, so the transfer
+// running and one more can be queued; each entry takes 17 bytes of RAM.
+#define I2C_QUEUE_SIZE 3
+// Payloads up to this size can be copied into the queue entry
+#define I2C_INLINE_SIZE 8
+
+// Transaction payload flags
+#define I2C_INLINE  0x01    // payload copied into the transaction
+#define I2C_FILL    0x02    // first payload byte repeated len times
+#define I2C_PROGMEM 0x04    // payload pointer refers to flash
 
 class I2C {
 public:
-    void init(uint8_t address);
+    template <uint32_t scl = I2C_SCL_CLOCK>
+    void init(uint8_t address) {
+        init(address, I2CClock<scl>::twbr, I2CClock<scl>::twps);
+    }
+    void init(uint8_t address, uint8_t twbr, uint8_t twps);
     uint8_t start();
     uint8_t write(uint8_t data);
+    uint8_t write(const uint8_t * data, uint16_t len);
+    uint8_t fill(uint8_t value, uint16_t len);
     void stop(void);
+
+    // The blocking calls above and the queue report I2C_OK or one of the
+    // I2C_ERR_* codes; every wait for the bus is bounded by
+    // I2C_TIMEOUT_LOOPS polls.
+
+    // Queues an addressed write of the control byte followed by len
+    // payload bytes and returns once it is queued. The transfer is driven
+    // from TWI_vect; a RAM payload which is not I2C_INLINE has to stay
+    // untouched until the transaction is done. An I2C_INLINE payload may be
+    // at most I2C_INLINE_SIZE bytes, longer ones are refused with
+    // I2C_ERR_SIZE and nothing is queued. done() is called from the
+    // interrupt with the transaction status.
+    uint8_t submit(uint8_t control, const uint8_t * data, uint16_t len,
+                   uint8_t flags = 0, void (*done)(uint8_t status) = 0);
+    static uint8_t busy();
+    // Waits for the queue to drain. Returns the first error of a queued
+    // transaction since the last flush(), also one dropped by recover(),
+    // and forgets it.
+    static uint8_t flush();
+    // Status of the last transaction
+    static uint8_t status();
+    static void recover();
+
+    static void handleInterrupt();
+
 private:
+    struct Transaction {
+        uint8_t address;
+        uint8_t twbr;
+        uint8_t twps;
+        uint8_t control;
+        uint8_t flags;
+        uint16_t len;
+        union {
+            const uint8_t * data;
+            uint8_t bytes[I2C_INLINE_SIZE];
+        };
+        void (*done)(uint8_t status);
+
+        uint8_t byteAt(uint16_t index) const;
+    };
+
+    static void setClock(uint8_t twbr, uint8_t twps);
+    static void finish(uint8_t status);
+    static uint8_t startQueue();
+    static uint8_t wait(uint8_t freeSlot);
+    static uint8_t waitInterrupt();
+
+    static Transaction queue[I2C_QUEUE_SIZE];
+    static volatile uint8_t queueHead;
+    static volatile uint8_t queueTail;
+    static volatile uint8_t running;
+    static volatile uint8_t progress;
+    static volatile uint8_t lastStatus;
+    static volatile uint8_t fault;
+    static uint16_t position;
+
     uint8_t address;
+    uint8_t twbr;
+    uint8_t twps;
     uint8_t twi_status_register;
 };
 
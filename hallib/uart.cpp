@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/delay.h>
 
 #include "uart.h"
 
@@ -22,10 +24,108 @@
 
 #define BAUD_PRESCALLER (((F_CPU / (UART_BAUDRATE * UART_DIVIDER))) - 1)
 
+#if UART_RX_BUFFER_SIZE & (UART_RX_BUFFER_SIZE - 1)
+#error "UART_RX_BUFFER_SIZE has to be a power of two"
+#endif
+#if UART_TX_BUFFER_SIZE & (UART_TX_BUFFER_SIZE - 1)
+#error "UART_TX_BUFFER_SIZE has to be a power of two"
+#endif
+
+static volatile uint8_t rx_buffer[UART_RX_BUFFER_SIZE];
+static volatile uint8_t rx_head = 0;
+static volatile uint8_t rx_tail = 0;
+
+static volatile uint8_t tx_buffer[UART_TX_BUFFER_SIZE];
+static volatile uint8_t tx_head = 0;
+static volatile uint8_t tx_tail = 0;
+// a byte went out since the last uart_flush()
+static volatile uint8_t tx_sent = 0;
+
+#if defined __AVR_ATmega328P__ || defined __AVR_ATmega168__
+static void tx_next()
+{
+	uint8_t tail = tx_tail;
+	// clear the transmit complete flag for uart_flush(), the error flags
+	// have to be written as zero
+	UCSR0A = (UCSR0A & ((1<<U2X0)|(1<<MPCM0))) | (1<<TXC0);
+	UDR0 = tx_buffer[tail];
+	tx_sent = 1;
+	tail = (tail + 1) & (UART_TX_BUFFER_SIZE - 1);
+	tx_tail = tail;
+	if(tail == tx_head) {
+		UCSR0B &= ~(1<<UDRIE0);
+	}
+}
+
+// With interrupts off nobody else feeds the transmitter
+static void tx_poll()
+{
+	if(!(SREG & (1<<SREG_I)) && tx_head != tx_tail && (UCSR0A & (1<<UDRE0))) {
+		tx_next();
+	}
+}
+
+static void tx_start()
+{
+	uint8_t sreg = SREG;
+	cli();
+	if(tx_head != tx_tail) {
+		UCSR0B |= 1<<UDRIE0;
+	}
+	SREG = sreg;
+}
+
+static void tx_put(uint8_t c)
+{
+	uint8_t head = tx_head;
+	uint8_t next = (head + 1) & (UART_TX_BUFFER_SIZE - 1);
+	if(next == tx_tail) {
+		tx_start();
+		while(next == tx_tail) {
+			tx_poll();
+		}
+	}
+	tx_buffer[head] = c;
+	tx_head = next;
+}
+
+void uart_write(const uint8_t * buf, uint8_t len)
+{
+	while(len--) {
+		tx_put(*buf++);
+	}
+	tx_start();
+}
+
+void uart_write_P(const uint8_t * buf, uint8_t len)
+{
+	while(len--) {
+		tx_put(pgm_read_byte(buf++));
+	}
+	tx_start();
+}
+
+void uart_flush()
+{
+	while(tx_head != tx_tail) {
+		tx_poll();
+	}
+	if(tx_sent) {
+		while(!(UCSR0A & (1<<TXC0)));
+		tx_sent = 0;
+	}
+}
+
+ISR(USART_UDRE_vect)
+{
+	tx_next();
+}
+#endif
+
 int uart_putchar(char c, FILE *) {
 #if defined __AVR_ATmega328P__ || defined __AVR_ATmega168__
-	while(!(UCSR0A & (1<<UDRE0)));
-	UDR0 = c;
+	tx_put(c);
+	tx_start();
 #endif
 #ifdef __AVR_ATmega8__
 	while(!(UCSRA & (1<<UDRE)));
@@ -36,6 +136,11 @@ int uart_putchar(char c, FILE *) {
 
 int uart_getchar(FILE *sttream) {
 #if defined __AVR_ATmega328P__ || defined __AVR_ATmega168__
+	if(UCSR0B & (1<<RXCIE0)) {
+		int c;
+		while((c = uart_read()) < 0);
+		return c;
+	}
 	while(!(UCSR0A & (1<<RXC0)));
 	return UDR0;
 #endif
@@ -46,18 +151,48 @@ int uart_getchar(FILE *sttream) {
 	return 0;
 }
 
-static void (*receiver_handler)(unsigned char) = 0;
+uint8_t uart_available()
+{
+	return (rx_head - rx_tail) & (UART_RX_BUFFER_SIZE - 1);
+}
+
+int uart_read()
+{
+	uint8_t tail = rx_tail;
+	if(tail == rx_head) {
+		return -1;
+	}
+	uint8_t c = rx_buffer[tail];
+	rx_tail = (tail + 1) & (UART_RX_BUFFER_SIZE - 1);
+	return c;
+}
 
-void set_receive_interrupt_handler(void (*handler)(unsigned char))
+uint8_t uart_read_timeout(uint8_t * buf, uint8_t len, uint16_t timeout_ms)
 {
-	receiver_handler = handler;
-	UCSR0B |= 1 << RXCIE0;
+	// polled in steps of 100 us, about a byte time at 115200 baud
+	uint32_t steps = timeout_ms * 10UL;
+	uint8_t n = 0;
+	while(n < len) {
+		int c = uart_read();
+		if(c >= 0) {
+			buf[n++] = c;
+		} else if(steps--) {
+			_delay_us(100);
+		} else {
+			break;
+		}
+	}
+	return n;
 }
 
 ISR(USART_RX_vect)
 {
-	if (receiver_handler != 0) {
-		(*receiver_handler)(UDR0);
+	uint8_t c = UDR0;
+	uint8_t head = rx_head;
+	uint8_t next = (head + 1) & (UART_RX_BUFFER_SIZE - 1);
+	if(next != rx_tail) {
+		rx_buffer[head] = c;
+		rx_head = next;
 	}
 }
 /*
@@ -70,8 +205,9 @@ void uart_init(int withInterrupt) {
 	UBRR0H = (uint8_t)(BAUD_PRESCALLER>>8);
 	UBRR0L = (uint8_t)(BAUD_PRESCALLER);
 	
+	UCSR0B = (1<<RXEN0)|(1<<TXEN0);
 	if(withInterrupt) {
-		UCSR0B = (1<<RXEN0)|(1<<TXEN0);
+		UCSR0B |= 1<<RXCIE0;
 	}
 
 	UCSR0C = ((1<<UCSZ00)|(1<<UCSZ01));
@@ -82,9 +218,7 @@ void uart_init(int withInterrupt) {
 	UBRRH = (uint8_t)(BAUD_PRESCALLER>>8);
 	UBRRL = (uint8_t)(BAUD_PRESCALLER);
 
-	if(withInterrupt) {
-		UCSRB = (1<<RXEN)|(1<<TXEN);
-	}
+	UCSRB = (1<<RXEN)|(1<<TXEN);
 
 	UCSRC = ((1<<URSEL)|(1<<UCSZ0)|(1<<UCSZ1));
 #if defined UART_DOUBLE_SPEED
@@ -3,9 +3,39 @@
 
 #include <stdio.h>
 
+#include <stdint.h>
+
+// Received bytes are queued from USART_RX_vect, a full buffer drops the
+// newest ones. Power of two, holds one byte less than its size; 16 takes
+// an MH-Z19 answer.
+#ifndef UART_RX_BUFFER_SIZE
+#define UART_RX_BUFFER_SIZE 16
+#endif
+
+// Bytes to send are queued and fed to the transmitter from
+// USART_UDRE_vect. Writers only wait while the buffer is full.
+#ifndef UART_TX_BUFFER_SIZE
+#define UART_TX_BUFFER_SIZE 16
+#endif
+
+// The receive interrupt fills the buffer below, without it uart_getchar()
+// polls the receiver.
 void uart_init(int interrupt = 1);
 int uart_putchar(char c, FILE * f = NULL);
 int uart_getchar(FILE * f = NULL);
-void set_receive_interrupt_handler(void (*handler)(unsigned char));
+
+// Queues len bytes for sending, from RAM or from flash
+void uart_write(const uint8_t * buf, uint8_t len);
+void uart_write_P(const uint8_t * buf, uint8_t len);
+// Waits until the queued bytes have left the transmitter
+void uart_flush();
+
+// Bytes waiting in the receive buffer
+uint8_t uart_available();
+// Next received byte, -1 when none is waiting
+int uart_read();
+// Reads up to len bytes, waiting at most timeout_ms for them. Returns the
+// number of bytes read.
+uint8_t uart_read_timeout(uint8_t * buf, uint8_t len, uint16_t timeout_ms);
 
 #endif /* defined _uart_h */
@@ -0,0 +1,142 @@
+#include <avr/pgmspace.h>
+#include <uart.h>
+
+#include "mhz19.h"
+
+static constexpr uint8_t len = 9;
+// Answers to the read command start with 0xFF 0x86
+static constexpr uint8_t startByte = 0xFF;
+static constexpr uint8_t readCo2 = 0x86;
+
+struct Frame {
+	uint8_t bytes[len];
+};
+
+// Command frame to sensor 1; the bytes after the start byte add up to
+// zero with the checksum
+static constexpr Frame frame(uint8_t command, uint8_t b3 = 0, uint8_t b4 = 0, uint8_t b6 = 0, uint8_t b7 = 0)
+{
+	return {{startByte, 0x01, command, b3, b4, 0x00, b6, b7,
+		static_cast<uint8_t>(-(0x01 + command + b3 + b4 + b6 + b7))}};
+}
+
+// By command number, the read command last
+static const Frame frames[] PROGMEM = {
+	frame(0x79, 0xA0),
+	frame(0x79),
+	frame(0x87),
+	frame(0x99, 0, 0, 2000 >> 8, 2000 & 0xFF),
+	frame(0x99, 0, 0, 5000 >> 8, 5000 & 0xFF),
+	frame(0x99, 0, 0, 10000 >> 8, 10000 & 0xFF),
+	frame(readCo2),
+};
+static constexpr uint8_t readCommand = MHZ19_RANGE_10000 + 1;
+static constexpr uint8_t spanCommand = readCommand + 1;
+
+static constexpr uint8_t abcGroup = 1 << MHZ19_ABC_ON | 1 << MHZ19_ABC_OFF;
+static constexpr uint8_t rangeGroup = 1 << MHZ19_RANGE_2000 | 1 << MHZ19_RANGE_5000 | 1 << MHZ19_RANGE_10000;
+
+void Mhz19::send(uint8_t command)
+{
+	uint8_t bit = 1 << command;
+	if(bit & abcGroup) {
+		pending &= ~abcGroup;
+	}
+	if(bit & rangeGroup) {
+		pending &= ~rangeGroup;
+	}
+	pending |= bit;
+}
+
+void Mhz19::calibrateSpan(uint16_t ppm)
+{
+	span = ppm;
+	pending |= 1 << spanCommand;
+}
+
+void Mhz19::request()
+{
+	// a late answer to the last request must not be taken for this one
+	while(uart_read() >= 0);
+
+	sendNext();
+	result = MHZ19_BUSY;
+}
+
+void Mhz19::sendNext()
+{
+	pos = 0;
+	polls = 0;
+	skip = len;
+	for(uint8_t i = 0; i < readCommand; ++i) {
+		if(pending & 1 << i) {
+			pending &= ~(1 << i);
+			uart_write_P(frames[i].bytes, len);
+			return;
+		}
+	}
+	if(pending & 1 << spanCommand) {
+		pending &= ~(1 << spanCommand);
+		Frame f = frame(0x88, span >> 8, span & 0xFF);
+		uart_write(f.bytes, len);
+		return;
+	}
+	skip = 0;
+	uart_write_P(frames[readCommand].bytes, len);
+}
+
+uint8_t Mhz19::poll()
+{
+	if(result != MHZ19_BUSY) {
+		return 0;
+	}
+
+	if(skip) {
+		while(skip && uart_read() >= 0) {
+			--skip;
+		}
+		if(!skip || ++polls == MHZ19_COMMAND_POLLS) {
+			sendNext();
+		}
+		return 0;
+	}
+
+	int c;
+	while((c = uart_read()) >= 0) {
+		if(pos == 0) {
+			if(c == startByte) {
+				pos = 1;
+			}
+		} else if(pos == 1) {
+			// a start byte again may begin the real frame
+			pos = c == readCo2 ? 2 : c == startByte ? 1 : 0;
+			sum = c;
+		} else if(pos < len - 1) {
+			if(pos < 2 + sizeof(body)) {
+				body[pos - 2] = c;
+			}
+			sum += c;
+			++pos;
+		} else {
+			pos = 0;
+			if(static_cast<uint8_t>(sum + c)) {
+				return finish(MHZ19_ERR_CHECKSUM);
+			}
+			co2 = body[0] << 8 | body[1];
+			temp = body[2] - 40;
+			state = body[3];
+			return finish(MHZ19_OK);
+		}
+	}
+
+	if(++polls == MHZ19_TIMEOUT_POLLS) {
+		return finish(MHZ19_ERR_TIMEOUT);
+	}
+	return 0;
+}
+
+uint8_t Mhz19::finish(uint8_t status)
+{
+	result = status;
+	return 1;
+}
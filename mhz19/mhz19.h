@@ -0,0 +1,85 @@
+#ifndef _MHZ19_H_
+#define _MHZ19_H_
+
+#include <stdint.h>
+
+// poll() calls without a complete answer before a request is given up
+#ifndef MHZ19_TIMEOUT_POLLS
+#define MHZ19_TIMEOUT_POLLS 10
+#endif
+
+// poll() calls waiting for the answer to a queued command before the next
+// frame goes out; some commands are not answered at all
+#ifndef MHZ19_COMMAND_POLLS
+#define MHZ19_COMMAND_POLLS 5
+#endif
+
+// Request results
+#define MHZ19_OK            0
+#define MHZ19_BUSY          1   // the answer is still expected
+#define MHZ19_ERR_TIMEOUT   2   // no complete answer in MHZ19_TIMEOUT_POLLS
+#define MHZ19_ERR_CHECKSUM  3   // an answer arrived but was corrupted
+
+// Commands for send()
+#define MHZ19_ABC_ON        0   // automatic baseline correction
+#define MHZ19_ABC_OFF       1
+#define MHZ19_ZERO          2   // calibrate the zero point to 400 ppm
+#define MHZ19_RANGE_2000    3   // detection range in ppm
+#define MHZ19_RANGE_5000    4
+#define MHZ19_RANGE_10000   5
+
+// MH-Z19 CO2 sensor on the UART. request() queues the read command and
+// returns, poll() parses the bytes received so far, so neither waits for
+// the exchange at 9600 baud.
+class Mhz19 {
+public:
+	// Queues a command, sent ahead of the read command by the next
+	// request(). A command replaces one of its group still pending, ABC on
+	// and off or the ranges. The sensor answers these with frames which
+	// poll() skips.
+	void send(uint8_t command);
+	// Queues a span calibration at ppm, like send()
+	void calibrateSpan(uint16_t ppm);
+
+	// Starts a CO2 reading, a pending one is dropped. The queued commands
+	// go out first, each after poll() has seen the answer to the one
+	// before, so the UART buffers only ever hold one frame.
+	void request();
+	// Parses the received bytes. Returns 1 once when the request has
+	// finished, status() tells how.
+	uint8_t poll();
+	uint8_t status() const { return result; }
+
+	// Values of the last good answer
+	uint16_t ppm() const { return co2; }
+	// Sensor temperature in 1 C steps, it runs a little above ambient
+	int8_t temperature() const { return temp; }
+	uint8_t sensorStatus() const { return state; }
+
+private:
+	// sends the next queued command or the read command
+	void sendNext();
+	uint8_t finish(uint8_t status);
+
+	// commands for the next request(), by bit
+	uint8_t pending = 0;
+	uint16_t span = 0;
+
+	// frame byte expected next, 0 while looking for the start byte
+	uint8_t pos = 0;
+	// answer bytes of the last command still to skip
+	uint8_t skip = 0;
+	// of the bytes after the start byte, zero over a whole frame
+	uint8_t sum = 0;
+	uint8_t polls = 0;
+	uint8_t result = MHZ19_OK;
+	// CO2 high and low byte, temperature + 40 and status of the frame
+	// being received
+	uint8_t body[4];
+
+	uint16_t co2 = 0;
+	int8_t temp = 0;
+	uint8_t state = 0;
+};
+
+#endif
@@ -26,6 +26,8 @@ For more information, please refer to <http://unlicense.org/>
 */
 
 #include <stdint.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
 #include "SSD1306.h"
 
 #ifdef SIMULATOR
@@ -34,62 +36,132 @@ For more information, please refer to <http://unlicense.org/>
 #include "I2C.h"
 #endif
 
-void SSD1306::init() {
-    i2c.init(SSD1306_DEFAULT_ADDRESS);
-
+// Sent as one command stream right after reset
+static const uint8_t initSequence[] PROGMEM = {
     // Turn display off
-    sendCommand(SSD1306_DISPLAYOFF);
-
-    sendCommand(SSD1306_SETDISPLAYCLOCKDIV);
-    sendCommand(0x80);
-
-    sendCommand(SSD1306_SETMULTIPLEX);
-    sendCommand(0x3F);
-    
-    sendCommand(SSD1306_SETDISPLAYOFFSET);
-    sendCommand(0x00);
-    
-    sendCommand(SSD1306_SETSTARTLINE | 0x00);
-    
+    SSD1306_DISPLAYOFF,
+
+    SSD1306_SETDISPLAYCLOCKDIV, 0x80,
+
+    SSD1306_SETMULTIPLEX, 0x3F,
+
+    SSD1306_SETDISPLAYOFFSET, 0x00,
+
+    SSD1306_SETSTARTLINE | 0x00,
+
     // We use internal charge pump
-    sendCommand(SSD1306_CHARGEPUMP);
-    sendCommand(0x14);
-    
+    SSD1306_CHARGEPUMP, 0x14,
+
     // Horizontal memory mode
-    sendCommand(SSD1306_MEMORYMODE);
-    sendCommand(0x00);
-    
-    sendCommand(SSD1306_SEGREMAP | 0x1);
+    SSD1306_MEMORYMODE, SSD1306_HORIZONTAL_MODE,
+
+    SSD1306_SEGREMAP | 0x1,
 
-    sendCommand(SSD1306_COMSCANDEC);
+    SSD1306_COMSCANDEC,
 
-    sendCommand(SSD1306_SETCOMPINS);
-    sendCommand(0x12);
+    SSD1306_SETCOMPINS, 0x12,
 
     // Max contrast
-    sendCommand(SSD1306_SETCONTRAST);
-    sendCommand(0xCF);
+    SSD1306_SETCONTRAST, 0xCF,
 
-    sendCommand(SSD1306_SETPRECHARGE);
-    sendCommand(0xF1);
+    SSD1306_SETPRECHARGE, 0xF1,
 
-    sendCommand(SSD1306_SETVCOMDETECT);
-    sendCommand(0x40);
+    SSD1306_SETVCOMDETECT, 0x40,
 
-    sendCommand(SSD1306_DISPLAYALLON_RESUME);
+    SSD1306_DISPLAYALLON_RESUME,
 
     // Non-inverted display
-    sendCommand(SSD1306_NORMALDISPLAY);
+    SSD1306_NORMALDISPLAY,
 
     // Turn display back on
-    sendCommand(SSD1306_DISPLAYON);
+    SSD1306_DISPLAYON,
+};
+
+void SSD1306::init() {
+    i2c.init<SSD1306_SCL_CLOCK>(SSD1306_DEFAULT_ADDRESS);
+    sendCommands_P(initSequence, sizeof(initSequence));
+    mode = SSD1306_HORIZONTAL_MODE;
+    invalidate();
 }
 
 void SSD1306::sendCommand(uint8_t command) {
-    i2c.start();
-    i2c.write(0x00);
-    i2c.write(command);
-    i2c.stop();
+    i2c.submit(0x00, &command, 1, I2C_INLINE);
+}
+
+// A control byte of 0x00 followed by several commands, one transaction
+void SSD1306::sendCommands(const uint8_t * commands, uint8_t len) {
+    i2c.submit(0x00, commands, len, len <= I2C_INLINE_SIZE ? I2C_INLINE : 0);
+}
+
+void SSD1306::sendCommands_P(const uint8_t * commands, uint8_t len) {
+    i2c.submit(0x00, commands, len, I2C_PROGMEM);
+}
+
+// RAM payloads longer than I2C_INLINE_SIZE are sent straight from the
+// caller's buffer, which has to stay untouched until flush()
+void SSD1306::sendData(const uint8_t * data, uint16_t len, uint8_t flags) {
+    if (!flags && len <= I2C_INLINE_SIZE) {
+        flags = I2C_INLINE;
+    }
+    i2c.submit(0x40, data, len, flags);
+}
+
+void SSD1306::fillData(uint8_t value, uint16_t len) {
+    i2c.submit(0x40, &value, len, I2C_FILL);
+}
+
+// The segment checksums are taken when a run is queued. A transfer which
+// failed since the last flush, even one dropped by a bus recovery, leaves
+// the panel content and the addressing mode unknown.
+void SSD1306::flush() {
+    if (i2c.flush()) {
+        invalidate();
+        // the lost transfer may have held a MEMORYMODE switch
+        mode = SSD1306_UNKNOWN_MODE;
+        failed = 1;
+    }
+}
+
+uint8_t SSD1306::busy() {
+    return i2c.busy();
+}
+
+uint8_t SSD1306::lost() {
+    uint8_t result = failed;
+    failed = 0;
+    return result;
+}
+
+// Runs inside one page use page addressing: page start plus the column
+// nibbles, three command bytes. Anything spanning pages goes through the
+// horizontal mode window. The mode is switched in the same transaction.
+void SSD1306::setWindow(uint8_t x, uint8_t xEnd, uint8_t page, uint8_t pageEnd) {
+    uint8_t window[8];
+    uint8_t n = 0;
+
+    if (page == pageEnd) {
+        if (mode != SSD1306_PAGE_MODE) {
+            mode = SSD1306_PAGE_MODE;
+            window[n++] = SSD1306_MEMORYMODE;
+            window[n++] = mode;
+        }
+        window[n++] = SSD1306_SETPAGESTART | page;
+        window[n++] = SSD1306_SETLOWCOLUMN | (x & 0x0F);
+        window[n++] = SSD1306_SETHIGHCOLUMN | (x >> 4);
+    } else {
+        if (mode != SSD1306_HORIZONTAL_MODE) {
+            mode = SSD1306_HORIZONTAL_MODE;
+            window[n++] = SSD1306_MEMORYMODE;
+            window[n++] = mode;
+        }
+        window[n++] = SSD1306_COLUMNADDR;
+        window[n++] = x;
+        window[n++] = xEnd;
+        window[n++] = SSD1306_PAGEADDR;
+        window[n++] = page;
+        window[n++] = pageEnd;
+    }
+    sendCommands(window, n);
 }
 
 void SSD1306::invert(uint8_t inverted) {
@@ -102,85 +174,63 @@ void SSD1306::invert(uint8_t inverted) {
 
 void SSD1306::clear()
 {
-    sendCommand(SSD1306_COLUMNADDR);
-    sendCommand(0x00);
-    sendCommand(0x7F);
-
-    sendCommand(SSD1306_PAGEADDR);
-    sendCommand(0x00);
-    sendCommand(0x07);
-
-    // We have to send the buffer as 16 bytes packets
-    // Our buffer is 1024 bytes long, 1024/16 = 64
-    // We have to send 64 packets
-    for (uint16_t packet = 0; packet < 64; packet++) {
-        i2c.start();
-        i2c.write(0x40);
-        for (uint16_t packet_byte = 0; packet_byte < 16; ++packet_byte) {
-            i2c.write(0x00);
+    setWindow(0, SSD1306_WIDTH - 1, 0, SSD1306_HEIGHT/8 - 1);
+
+    // The whole 1024 bytes frame goes out as one transaction
+    fillData(0x00, SSD1306_BUFFERSIZE);
+
+    uint8_t zero = 0;
+    uint16_t crc = checksum(0, SSD1306_SEGMENT_WIDTH, &zero, I2C_FILL);
+    for (uint8_t page = 0; page < SSD1306_HEIGHT/8; ++page) {
+        for (uint8_t s = 0; s < SSD1306_SEGMENTS; ++s) {
+            checksums[page][s] = crc;
         }
-        i2c.stop();
+        valid[page] = 0xFF;
     }
 }
 
+void SSD1306::invalidate()
+{
+    for (uint8_t page = 0; page < SSD1306_HEIGHT/8; ++page) {
+        valid[page] = 0;
+    }
+}
+
+void SSD1306::invalidate(uint8_t page, uint8_t x, uint8_t width)
+{
+    valid[page] &= ~segmentMask(x, width);
+}
+
+void SSD1306::sendFramebuffer(const uint8_t * buffer) {
+    setWindow(0, SSD1306_WIDTH - 1, 0, SSD1306_HEIGHT/8 - 1);
+    sendData(buffer, SSD1306_BUFFERSIZE);
+    invalidate();
+}
+
 void SSD1306::send8x8glyph(uint8_t page, uint8_t col, uint8_t * glyph, uint8_t len) {
-    sendCommand(SSD1306_COLUMNADDR);
-    sendCommand(col);
-    sendCommand(0x7F);
-
-    sendCommand(SSD1306_PAGEADDR);
-    sendCommand(page);
-    sendCommand(0x07);
-
-    // We have to send the buffer as 16 bytes packets
-    // Our buffer is 1024 bytes long, 1024/16 = 64
-    // We have to send 64 packets
-   // for (uint16_t packet = 0; packet < 64; packet++) {
-        i2c.start();
-        i2c.write(0x40);
-        for (uint16_t packet_byte = 0; packet_byte < len; ++packet_byte) {
-            i2c.write(glyph[packet_byte]);;
-        }
-        i2c.stop();
-    //}
+    setWindow(col, 0x7F, page, page);
+    sendData(glyph, len);
+    invalidate(page, col, len);
 }
 
 void SSD1306::drawPixel(uint8_t x, uint8_t y, bool on) {
-    sendCommand(SSD1306_COLUMNADDR);
-    sendCommand(x);
-    sendCommand(0x7F);
-
-    sendCommand(SSD1306_PAGEADDR);
-    sendCommand(y/8);
-    sendCommand(0x07);
+    setWindow(x, 0x7F, y/8, y/8);
 
 		uint8_t pattern = on;
 		pattern <<= y%8;
 		
-		i2c.start();
-		i2c.write(0x40);
-		i2c.write(pattern);
-		i2c.stop();
+		sendData(&pattern, 1);
+		invalidate(y/8, x, 1);
 }
 
 void SSD1306::drawLineH(uint8_t x, uint8_t y, uint8_t len) {
-  sendCommand(SSD1306_COLUMNADDR);
-  sendCommand(x);
-  sendCommand(0x7F);
-
-	for(int i = 0; i < len; ++i) {
-    sendCommand(SSD1306_PAGEADDR);
-    sendCommand(y/8);
-    sendCommand(0x07);
-		
-		uint8_t pattern = 1;
-		pattern <<= y%8;
-		
-		i2c.start();
-		i2c.write(0x40);
-		i2c.write(pattern);
-		i2c.stop();
-	}
+	setWindow(x, 0x7F, y/8, y/8);
+
+	uint8_t pattern = 1;
+	pattern <<= y%8;
+
+	fillData(pattern, len);
+	invalidate(y/8, x, len);
 }
 
 void SSD1306::drawLineV(uint8_t x, uint8_t y, uint8_t len) {
@@ -188,14 +238,6 @@ void SSD1306::drawLineV(uint8_t x, uint8_t y, uint8_t len) {
 	int startPage = y/8;
 	int startPageYOffset = y%8;
 
-	sendCommand(SSD1306_COLUMNADDR);
-	sendCommand(x);
-	sendCommand(0x7F);
-
-	sendCommand(SSD1306_PAGEADDR);
-	sendCommand(startPage);
-	sendCommand(0x07);
-
 	uint8_t pattern = 1;
 	for(int j = 1; j < len; ++j) {
 		pattern <<= 1;
@@ -205,96 +247,202 @@ void SSD1306::drawLineV(uint8_t x, uint8_t y, uint8_t len) {
 	while(startPageYOffset--) {
 		pattern <<= 1;
 	}
-	
-	i2c.start();
-	i2c.write(0x40);
-	i2c.write(pattern);
-	i2c.stop();
+
+	uint8_t column[SSD1306_HEIGHT/8 + 1];
+	uint8_t n = 0;
+	column[n++] = pattern;
 
 	// remove drawed part from len
 
 	if(len >= 8-(y%8)) {
 		len -= 8-(y%8);
 	} else {
-		return;
+		len = 0;
 	}
 	
-	int k = 0;
 	while(len > 8) {
-		k++;
 		len -= 8;
-		sendCommand(SSD1306_COLUMNADDR);
-		sendCommand(x);
-		sendCommand(0x7F);
-		sendCommand(SSD1306_PAGEADDR);
-		sendCommand(startPage+k);
-		sendCommand(0x07);
-
-		i2c.start();
-		i2c.write(0x40);
-		i2c.write(0xFF);
-		i2c.stop();
+		column[n++] = 0xFF;
 	}
 
+	if(len != 0) {
+		pattern = 1;
+		while(len-- > 1) {
+			pattern <<= 1;
+			pattern |= 1;
+		}
+		column[n++] = pattern;
+	}
 
-	if(len == 0) {
-		return;
+	// Nothing below the last page is visible
+	if(n > SSD1306_HEIGHT/8 - startPage) {
+		n = SSD1306_HEIGHT/8 - startPage;
 	}
 
-	pattern = 1;
-	while(len-- > 1) {
-		pattern <<= 1;
-		pattern |= 1;
+	// A single column window: every data byte lands on the next page
+	setWindow(x, x, startPage, startPage + n - 1);
+	sendData(column, n);
+	for(uint8_t i = 0; i < n; ++i) {
+		invalidate(startPage + i, x, 1);
 	}
-	sendCommand(SSD1306_COLUMNADDR);
-	sendCommand(x);
-	sendCommand(0x7F);
-	sendCommand(SSD1306_PAGEADDR);
-	sendCommand(startPage+k+1);
-	sendCommand(0x07);
-
-	i2c.start();
-	i2c.write(0x40);
-	i2c.write(pattern);
-	i2c.stop();
-	
 }
 
 void SSD1306::drawPage(uint8_t * buffer, int page, uint8_t x, uint8_t width)
 {
-  sendCommand(SSD1306_COLUMNADDR);
-  sendCommand(x);
-  sendCommand(0x7F);
-  
-	sendCommand(SSD1306_PAGEADDR);
-  sendCommand(page);
-	sendCommand(0x07);
-
-	for(uint8_t i = 0; i < width; ++i) {
-		
-		i2c.start();
-		i2c.write(0x40);
-		i2c.write(buffer[i]);
-		i2c.stop();
-	}
+	writeRun(page, x, width, buffer, 0);
 }
 
 void SSD1306::clearPage(int page, uint8_t x, uint8_t width)
 {
-  sendCommand(SSD1306_COLUMNADDR);
-  sendCommand(x);
-  sendCommand(0x7F);
-  
-	sendCommand(SSD1306_PAGEADDR);
-  sendCommand(page);
-	sendCommand(0x07);
-
-	for(uint8_t i = 0; i < width; ++i) {
-		
-		i2c.start();
-		i2c.write(0x40);
-		i2c.write(0);
-		i2c.stop();
+	uint8_t zero = 0;
+	writeRun(page, x, width, &zero, I2C_FILL);
+}
+
+void SSD1306::drawPages(const uint8_t * buffer, uint8_t page, uint8_t pages, uint8_t x, uint8_t width, uint8_t stride)
+{
+	writeBlock(buffer, page, pages, x, width, stride, 0);
+}
+
+void SSD1306::drawPages_P(const uint8_t * buffer, uint8_t page, uint8_t pages, uint8_t x, uint8_t width, uint8_t stride)
+{
+	writeBlock(buffer, page, pages, x, width, stride, I2C_PROGMEM);
+}
+
+void SSD1306::clearPages(uint8_t page, uint8_t pages, uint8_t x, uint8_t width)
+{
+	uint8_t zero = 0;
+	writeBlock(&zero, page, pages, x, width, 0, I2C_FILL);
+}
+
+void SSD1306::scrollLeft(uint8_t page, uint8_t pages, uint8_t x, uint8_t width)
+{
+    const uint8_t commands[] = {
+        SSD1306_CONTENTSCROLL_LEFT, 0x00,
+        page, 0x01, static_cast<uint8_t>(page + pages - 1), 0x00,
+        x, static_cast<uint8_t>(x + width - 1)
+    };
+    sendCommands(commands, sizeof(commands));
+
+    // the cached checksums describe the content before the shift
+    for (uint8_t i = 0; i < pages; ++i) {
+        invalidate(page + i, x, width);
+    }
+}
+
+void SSD1306::writeRun(uint8_t page, uint8_t x, uint8_t width, const uint8_t * data, uint8_t flags)
+{
+	sendRuns(page, x, width, data, flags, changedSegments(page, x, width, data, flags));
+}
+
+void SSD1306::writeBlock(const uint8_t * data, uint8_t page, uint8_t pages, uint8_t x, uint8_t width, uint8_t stride, uint8_t flags)
+{
+	uint8_t changed[SSD1306_HEIGHT/8];
+	uint8_t touched = segmentMask(x, width);
+	uint8_t whole = 1;
+
+	for(uint8_t i = 0; i < pages; ++i) {
+		changed[i] = changedSegments(page + i, x, width, data + i * stride, flags);
+		if(changed[i] != touched) {
+			whole = 0;
+		}
+	}
+
+	if(!whole) {
+		for(uint8_t i = 0; i < pages; ++i) {
+			sendRuns(page + i, x, width, data + i * stride, flags, changed[i]);
+		}
+		return;
+	}
+
+	// The window wraps after width columns, so the rows of the block
+	// follow each other without addressing in between
+	setWindow(x, x + width - 1, page, page + pages - 1);
+
+	if(width == stride || (flags & I2C_FILL)) {
+		sendData(data, static_cast<uint16_t>(width) * pages, flags);
+		return;
+	}
+	for(uint8_t i = 0; i < pages; ++i) {
+		sendData(data + i * stride, width, flags);
+	}
+}
+
+// Each page is split into SSD1306_SEGMENTS segments. A segment keeps the
+// CRC of the last run written into it, together with the run's offset and
+// length. A run that matches it is already on the panel and is skipped.
+uint8_t SSD1306::segmentMask(uint8_t x, uint8_t width)
+{
+	if(!width) {
+		return 0;
 	}
+	uint8_t first = x / SSD1306_SEGMENT_WIDTH;
+	uint8_t last = (x + width - 1) / SSD1306_SEGMENT_WIDTH;
+	return static_cast<uint8_t>((2 << last) - (1 << first));
 }
 
+uint16_t SSD1306::checksum(uint8_t offset, uint8_t len, const uint8_t * data, uint8_t flags)
+{
+	uint16_t crc = _crc_ccitt_update(0xFFFF, offset);
+	crc = _crc_ccitt_update(crc, len);
+	for(uint8_t i = 0; i < len; ++i) {
+		uint8_t b;
+		if(flags & I2C_FILL) {
+			b = *data;
+		} else if(flags & I2C_PROGMEM) {
+			b = pgm_read_byte(data + i);
+		} else {
+			b = data[i];
+		}
+		crc = _crc_ccitt_update(crc, b);
+	}
+	return crc;
+}
+
+uint8_t SSD1306::changedSegments(uint8_t page, uint8_t x, uint8_t width, const uint8_t * data, uint8_t flags)
+{
+	uint8_t changed = 0;
+	uint8_t end = x + width;
+
+	for(uint8_t lo = x; lo < end; ) {
+		uint8_t s = lo / SSD1306_SEGMENT_WIDTH;
+		uint8_t segmentEnd = (s + 1) * SSD1306_SEGMENT_WIDTH;
+		uint8_t hi = end < segmentEnd ? end : segmentEnd;
+		uint16_t crc = checksum(lo - s * SSD1306_SEGMENT_WIDTH, hi - lo,
+		                       (flags & I2C_FILL) ? data : data + (lo - x), flags);
+		uint8_t bit = 1 << s;
+
+		if(!(valid[page] & bit) || checksums[page][s] != crc) {
+			checksums[page][s] = crc;
+			valid[page] |= bit;
+			changed |= bit;
+		}
+		lo = hi;
+	}
+	return changed;
+}
+
+// Writes the changed segments of a run, neighbours merged into one write
+void SSD1306::sendRuns(uint8_t page, uint8_t x, uint8_t width, const uint8_t * data, uint8_t flags, uint8_t changed)
+{
+	uint8_t end = x + width;
+	uint8_t lo = x;
+
+	while(lo < end) {
+		uint8_t hi = lo;
+		uint8_t write = changed & (1 << (lo / SSD1306_SEGMENT_WIDTH));
+
+		// extend the run while the following segments have the same state
+		do {
+			hi = (hi / SSD1306_SEGMENT_WIDTH + 1) * SSD1306_SEGMENT_WIDTH;
+		} while(hi < end && !(changed & (1 << (hi / SSD1306_SEGMENT_WIDTH))) == !write);
+		if(hi > end) {
+			hi = end;
+		}
+
+		if(write) {
+			setWindow(lo, 0x7F, page, page);
+			sendData((flags & I2C_FILL) ? data : data + (lo - x), hi - lo, flags);
+		}
+		lo = hi;
+	}
+}
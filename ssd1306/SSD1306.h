@@ -31,6 +31,11 @@ For more information, please refer to <http://unlicense.org/>
 #include "I2C.h"
 #endif
 
+// The controller is rated for 400 kHz, most panels run fine at 800 kHz
+#ifndef SSD1306_SCL_CLOCK
+#define SSD1306_SCL_CLOCK I2C_SCL_CLOCK
+#endif
+
 #define SSD1306_DEFAULT_ADDRESS 0x78
 //#define SSD1306_DEFAULT_ADDRESS 0x3C
 //#define SSD1306_DEFAULT_ADDRESS 0x7A
@@ -52,6 +57,11 @@ For more information, please refer to <http://unlicense.org/>
 #define SSD1306_SETHIGHCOLUMN 0x10
 #define SSD1306_SETSTARTLINE 0x40
 #define SSD1306_MEMORYMODE 0x20
+#define SSD1306_HORIZONTAL_MODE 0x00
+#define SSD1306_PAGE_MODE 0x02
+// not sent, forces the next window to set the mode again
+#define SSD1306_UNKNOWN_MODE 0xFF
+#define SSD1306_SETPAGESTART 0xB0
 #define SSD1306_COLUMNADDR 0x21
 #define SSD1306_PAGEADDR   0x22
 #define SSD1306_COMSCANINC 0xC0
@@ -60,11 +70,25 @@ For more information, please refer to <http://unlicense.org/>
 #define SSD1306_CHARGEPUMP 0x8D
 #define SSD1306_SWITCHCAPVCC 0x2
 #define SSD1306_NOP 0xE3
+#define SSD1306_CONTENTSCROLL_RIGHT 0x2C
+#define SSD1306_CONTENTSCROLL_LEFT 0x2D
 
 #define SSD1306_WIDTH 128
 #define SSD1306_HEIGHT 64
 #define SSD1306_BUFFERSIZE 1024
 
+// One-column content scroll (2Ch/2Dh). Not every SSD1306 or clone has it,
+// so by default the users redraw instead of scrolling
+#ifndef SSD1306_CONTENT_SCROLL
+#define SSD1306_CONTENT_SCROLL 0
+#endif
+// A content scroll takes up to two frames, nothing may be sent meanwhile
+#define SSD1306_SCROLL_DELAY_MS 25
+
+// Change detection granularity, one CRC16 per segment of a page
+#define SSD1306_SEGMENT_WIDTH 16
+#define SSD1306_SEGMENTS (SSD1306_WIDTH / SSD1306_SEGMENT_WIDTH)
+
 class SSD1306{
 private: 
     I2C i2c;
@@ -72,7 +96,7 @@ private:
 public:
 		void init();
 		void clear();
-    void sendFramebuffer(uint8_t, uint8_t);
+    void sendFramebuffer(const uint8_t * buffer);
 		void send8x8glyph(uint8_t page, uint8_t col, uint8_t * glyph, uint8_t len);
 		void drawPixel(uint8_t x, uint8_t y, bool on);
 		void drawLineH(uint8_t x, uint8_t y, uint8_t len);
@@ -80,7 +104,43 @@ public:
     void invert(uint8_t inverted);
 		void drawPage(uint8_t * buffer, int page, uint8_t x, uint8_t width);
 		void clearPage(int page, uint8_t x, uint8_t width);
+		void drawPages(const uint8_t * buffer, uint8_t page, uint8_t pages, uint8_t x, uint8_t width, uint8_t stride);
+		void drawPages_P(const uint8_t * buffer, uint8_t page, uint8_t pages, uint8_t x, uint8_t width, uint8_t stride);
+		void clearPages(uint8_t page, uint8_t pages, uint8_t x, uint8_t width);
+		// Moves the window content one column to the left on the panel, the
+		// rightmost column is undefined afterwards and has to be redrawn.
+		// Returns once the command is queued; the caller leaves the panel
+		// alone for SSD1306_SCROLL_DELAY_MS after that.
+		void scrollLeft(uint8_t page, uint8_t pages, uint8_t x, uint8_t width);
+		// Drawing returns once the transfer is queued; flush() waits for
+		// the panel to receive everything
+		void flush();
+		uint8_t busy();
+		// Non-zero once when a flush() found a transfer lost since the
+		// last call; the panel content is unknown and needs a full redraw
+		uint8_t lost();
+		// Forget what is on the panel, the next draws are all sent
+		void invalidate();
 private:
     void sendCommand(uint8_t command);
-    void sendData(uint8_t data);
+    void sendCommands(const uint8_t * commands, uint8_t len);
+    void sendCommands_P(const uint8_t * commands, uint8_t len);
+    void sendData(const uint8_t * data, uint16_t len, uint8_t flags = 0);
+    void fillData(uint8_t value, uint16_t len);
+    void setWindow(uint8_t x, uint8_t xEnd, uint8_t page, uint8_t pageEnd);
+
+    void writeRun(uint8_t page, uint8_t x, uint8_t width, const uint8_t * data, uint8_t flags);
+    void writeBlock(const uint8_t * data, uint8_t page, uint8_t pages, uint8_t x, uint8_t width, uint8_t stride, uint8_t flags);
+    void invalidate(uint8_t page, uint8_t x, uint8_t width);
+    uint8_t changedSegments(uint8_t page, uint8_t x, uint8_t width, const uint8_t * data, uint8_t flags);
+    void sendRuns(uint8_t page, uint8_t x, uint8_t width, const uint8_t * data, uint8_t flags, uint8_t changed);
+    static uint8_t segmentMask(uint8_t x, uint8_t width);
+    static uint16_t checksum(uint8_t offset, uint8_t len, const uint8_t * data, uint8_t flags);
+
+    uint8_t mode = SSD1306_HORIZONTAL_MODE;
+    uint16_t checksums[SSD1306_HEIGHT/8][SSD1306_SEGMENTS];
+    uint8_t valid[SSD1306_HEIGHT/8] = {0, };
+    uint8_t failed = 0;
+
+    static_assert(SSD1306_SEGMENTS <= 8, "segment masks are 8 bit");
 };